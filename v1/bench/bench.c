@@ -0,0 +1,471 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "my_malloc.h"
+
+/* ========================================================
+ * Allocator benchmark
+ * Runs every workload against every engine at 1, 2, 4, ...
+ * threads up to the number of online CPUs and prints one line
+ * per run: throughput, malloc/free latency percentiles and
+ * the peak RSS.  Each run happens in a child process of its
+ * own, so no run inherits another's heap or peak RSS.
+ *
+ *   ./bench [-e engines] [-w workloads] [-t max_threads]
+ *           [-n ops_per_thread]
+ *
+ * Engines: lock, nolock, tcache, lockfree and system (the C
+ * library's malloc); lock, nolock and system by default.
+ * Workloads:
+ *   tiny, mixed, large, powerlaw
+ *              random replacement in a private working set,
+ *              with sizes drawn from the named distribution
+ *   larson     the same with mixed sizes, but the working sets
+ *              rotate between threads every round, so most
+ *              frees are of another thread's memory
+ *   prodcons   producer threads hand every block to a consumer
+ *              thread, which frees it
+ *   xmalloc    threads allocate batches, trade them through a
+ *              shared stack and free whatever batch they get
+ *
+ * Latencies are of single malloc and free calls, timed on one
+ * call in LAT_EVERY and including the clock's own overhead.
+ * ======================================================== */
+
+#define WORKING_SET   1000      /* live blocks per thread            */
+#define ROUNDS        20        /* larson: working set hand-overs    */
+#define RING_SIZE     1024      /* prodcons: blocks in flight        */
+#define XBATCH        64        /* xmalloc: blocks per batch         */
+#define LAT_EVERY     8         /* time one call in this many        */
+#define LAT_SAMPLES   (1 << 16) /* latency samples kept per thread   */
+#define MAX_THREADS   256
+
+typedef struct engine {
+  const char *name;
+  void *(*malloc)(size_t size);
+  void (*free)(void *ptr);
+} engine_t;
+
+static const engine_t engines[] = {
+  { "lock",     ts_malloc_lock,     ts_free_lock },
+  { "nolock",   ts_malloc_nolock,   ts_free_nolock },
+  { "tcache",   ts_malloc_tcache,   ts_free_tcache },
+  { "lockfree", ts_malloc_lockfree, ts_free_lockfree },
+  { "system",   malloc,             free },
+};
+
+typedef struct thread_ctx thread_ctx_t;
+typedef void (*workload_fn)(thread_ctx_t *ctx);
+
+typedef struct workload {
+  const char *name;
+  workload_fn run;
+  size_t (*size)(thread_ctx_t *ctx);
+  int pairs;       /* needs an even number of threads, at least 2 */
+} workload_t;
+
+struct thread_ctx {
+  int id;
+  int threads;
+  size_t ops;                /* operations done, counted here   */
+  long start, end;           /* when this thread began and ended */
+  unsigned long rng;
+  const engine_t *engine;
+  const workload_t *workload;
+  unsigned nsamples;
+  unsigned lat_tick;
+  unsigned lat[LAT_SAMPLES]; /* nanoseconds per timed call      */
+};
+
+/* Shared by all threads of one run */
+static size_t ops_per_thread = 200000;
+static pthread_barrier_t barrier;        /* start: workers and main */
+static pthread_barrier_t round_barrier;  /* larson: workers only    */
+static void **working_sets[MAX_THREADS];
+
+/* ========================================================
+ * Helpers: random numbers, timing and size distributions
+ * ======================================================== */
+static inline unsigned long next_rand(thread_ctx_t *ctx) {
+  ctx->rng ^= ctx->rng << 13;
+  ctx->rng ^= ctx->rng >> 7;
+  ctx->rng ^= ctx->rng << 17;
+  return ctx->rng;
+}
+
+static inline long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static size_t size_tiny(thread_ctx_t *ctx) {
+  return 8 + next_rand(ctx) % 57;                  /* 8 .. 64 bytes     */
+}
+
+static size_t size_mixed(thread_ctx_t *ctx) {
+  return 16 + next_rand(ctx) % 4081;               /* 16 .. 4096 bytes  */
+}
+
+static size_t size_large(thread_ctx_t *ctx) {
+  return (4UL << 10) + next_rand(ctx) % (508UL << 10); /* 4 .. 512 KiB  */
+}
+
+/* Pareto, alpha 1.2 from 16 bytes, cut off at 1 MiB: mostly small
+ * blocks with a long tail of big ones */
+static size_t size_powerlaw(thread_ctx_t *ctx) {
+  double u = (double)((next_rand(ctx) >> 11) + 1) / (double)(1UL << 53);
+  double size = 16.0 * pow(u, -1.0 / 1.2);
+  return size < (1 << 20) ? (size_t)size : (1 << 20);
+}
+
+/* Time one call in LAT_EVERY; the others only pay a counter */
+static inline void *timed_malloc(thread_ctx_t *ctx, size_t size) {
+  if (++ctx->lat_tick % LAT_EVERY != 0 || ctx->nsamples == LAT_SAMPLES) {
+    return ctx->engine->malloc(size);
+  }
+  long start = now_ns();
+  void *ptr = ctx->engine->malloc(size);
+  ctx->lat[ctx->nsamples++] = now_ns() - start;
+  return ptr;
+}
+
+static inline void timed_free(thread_ctx_t *ctx, void *ptr) {
+  if (++ctx->lat_tick % LAT_EVERY != 0 || ctx->nsamples == LAT_SAMPLES) {
+    ctx->engine->free(ptr);
+    return;
+  }
+  long start = now_ns();
+  ctx->engine->free(ptr);
+  ctx->lat[ctx->nsamples++] = now_ns() - start;
+}
+
+/* Touch the block, as a program would */
+static inline void *use(void *ptr) {
+  if (ptr != NULL) {
+    *(volatile char *)ptr = 1;
+  }
+  return ptr;
+}
+
+/* ========================================================
+ * Workloads
+ * ======================================================== */
+
+/* Replace random members of a working set, freeing the old block */
+static void churn(thread_ctx_t *ctx, void **set, size_t ops) {
+  for (size_t i = 0; i < ops; i++) {
+    size_t slot = next_rand(ctx) % WORKING_SET;
+    if (set[slot] != NULL) {
+      timed_free(ctx, set[slot]);
+      ctx->ops++;
+    }
+    set[slot] = use(timed_malloc(ctx, ctx->workload->size(ctx)));
+    ctx->ops++;
+  }
+}
+
+static void run_sizes(thread_ctx_t *ctx) {
+  void **set = working_sets[ctx->id];
+  churn(ctx, set, ops_per_thread);
+}
+
+/* Every round each thread takes over the next thread's working set */
+static void run_larson(thread_ctx_t *ctx) {
+  for (int round = 0; round < ROUNDS; round++) {
+    void **set = working_sets[(ctx->id + round) % ctx->threads];
+    churn(ctx, set, ops_per_thread / ROUNDS);
+    pthread_barrier_wait(&round_barrier);
+  }
+}
+
+/* One single-producer, single-consumer ring per pair of threads */
+typedef struct ring {
+  void *slot[RING_SIZE];
+  size_t head __attribute__((aligned(64)));   /* next to take */
+  size_t tail __attribute__((aligned(64)));   /* next to fill */
+} ring_t;
+
+static ring_t rings[MAX_THREADS / 2];
+
+static void run_prodcons(thread_ctx_t *ctx) {
+  ring_t *ring = &rings[ctx->id / 2];
+
+  if (ctx->id % 2 == 0) {
+    for (size_t i = 0; i < ops_per_thread; i++) {
+      void *ptr = use(timed_malloc(ctx, size_mixed(ctx)));
+      size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+      while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+             RING_SIZE) {
+        sched_yield();
+      }
+      ring->slot[tail % RING_SIZE] = ptr;
+      __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+      ctx->ops++;
+    }
+  } else {
+    for (size_t i = 0; i < ops_per_thread; i++) {
+      size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+      while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+        sched_yield();
+      }
+      void *ptr = ring->slot[head % RING_SIZE];
+      __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+      if (ptr != NULL) {
+        timed_free(ctx, ptr);
+      }
+      ctx->ops++;
+    }
+  }
+}
+
+/* Batches waiting to be freed, by whichever thread comes next */
+typedef struct xbatch {
+  struct xbatch *next;
+  void *ptrs[XBATCH];
+} xbatch_t;
+
+static pthread_mutex_t xstack_mutex = PTHREAD_MUTEX_INITIALIZER;
+static xbatch_t *xstack = NULL;
+
+static void xfree_batch(thread_ctx_t *ctx, xbatch_t *batch) {
+  for (int i = 0; i < XBATCH; i++) {
+    if (batch->ptrs[i] != NULL) {
+      timed_free(ctx, batch->ptrs[i]);
+      ctx->ops++;
+    }
+  }
+  free(batch);
+}
+
+static void run_xmalloc(thread_ctx_t *ctx) {
+  for (size_t done = 0; done < ops_per_thread; done += XBATCH) {
+    xbatch_t *batch = malloc(sizeof(*batch));
+    for (int i = 0; i < XBATCH; i++) {
+      batch->ptrs[i] = use(timed_malloc(ctx, size_tiny(ctx)));
+      ctx->ops++;
+    }
+
+    pthread_mutex_lock(&xstack_mutex);
+    batch->next = xstack;
+    xstack = batch;
+    batch = xstack->next;
+    xstack->next = batch != NULL ? batch->next : NULL;
+    pthread_mutex_unlock(&xstack_mutex);
+
+    if (batch != NULL) {
+      xfree_batch(ctx, batch);
+    }
+  }
+}
+
+static const workload_t workloads[] = {
+  { "tiny",     run_sizes,    size_tiny,     0 },
+  { "mixed",    run_sizes,    size_mixed,    0 },
+  { "large",    run_sizes,    size_large,    0 },
+  { "powerlaw", run_sizes,    size_powerlaw, 0 },
+  { "larson",   run_larson,   size_mixed,    0 },
+  { "prodcons", run_prodcons, size_mixed,    1 },
+  { "xmalloc",  run_xmalloc,  size_tiny,     0 },
+};
+
+/* ========================================================
+ * Running one configuration
+ * ======================================================== */
+typedef struct result {
+  double ops_per_sec;
+  unsigned p50, p99, p999;   /* nanoseconds */
+  long peak_rss_kb;
+} result_t;
+
+static void *thread_main(void *arg) {
+  thread_ctx_t *ctx = arg;
+  pthread_barrier_wait(&barrier);
+  ctx->start = now_ns();
+  ctx->workload->run(ctx);
+  ctx->end = now_ns();
+  return NULL;
+}
+
+static int cmp_unsigned(const void *a, const void *b) {
+  unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Runs in the child; the parent only sees the result */
+static result_t run_config(const engine_t *engine, const workload_t *workload,
+                           int threads) {
+  result_t result = { 0 };
+  pthread_t tids[MAX_THREADS];
+  thread_ctx_t *ctx = calloc(threads, sizeof(*ctx));
+
+  for (int i = 0; i < threads; i++) {
+    working_sets[i] = calloc(WORKING_SET, sizeof(void *));
+    ctx[i].id = i;
+    ctx[i].threads = threads;
+    ctx[i].rng = 0x9e3779b97f4a7c15UL * (i + 1);
+    ctx[i].engine = engine;
+    ctx[i].workload = workload;
+  }
+
+  pthread_barrier_init(&barrier, NULL, threads + 1);
+  pthread_barrier_init(&round_barrier, NULL, threads);
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&tids[i], NULL, thread_main, &ctx[i]);
+  }
+  pthread_barrier_wait(&barrier);
+  for (int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  /* From the first thread starting to the last one finishing */
+  size_t ops = 0, nsamples = 0;
+  long start = ctx[0].start, end = ctx[0].end;
+  for (int i = 0; i < threads; i++) {
+    ops += ctx[i].ops;
+    nsamples += ctx[i].nsamples;
+    start = ctx[i].start < start ? ctx[i].start : start;
+    end = ctx[i].end > end ? ctx[i].end : end;
+  }
+  long elapsed = end - start;
+  unsigned *lat = malloc((nsamples + 1) * sizeof(unsigned));
+  size_t n = 0;
+  for (int i = 0; i < threads; i++) {
+    memcpy(lat + n, ctx[i].lat, ctx[i].nsamples * sizeof(unsigned));
+    n += ctx[i].nsamples;
+  }
+  qsort(lat, n, sizeof(unsigned), cmp_unsigned);
+  if (n > 0) {
+    result.p50 = lat[n / 2];
+    result.p99 = lat[n * 99 / 100];
+    result.p999 = lat[n * 999 / 1000];
+  }
+  result.ops_per_sec = elapsed > 0 ? ops * 1e9 / elapsed : 0;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  result.peak_rss_kb = usage.ru_maxrss;
+  return result;
+}
+
+/* Fork, run in the child, and read the result back through a pipe */
+static int run_isolated(const engine_t *engine, const workload_t *workload,
+                        int threads, result_t *result) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return 0;
+  }
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    result_t r = run_config(engine, workload, threads);
+    ssize_t written = write(fds[1], &r, sizeof(r));
+    _exit(written == sizeof(r) ? 0 : 1);
+  }
+  close(fds[1]);
+  ssize_t got = pid > 0 ? read(fds[0], result, sizeof(*result)) : -1;
+  close(fds[0]);
+
+  int status = 0;
+  if (pid > 0) {
+    waitpid(pid, &status, 0);
+  }
+  return got == sizeof(*result) && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+/* ========================================================
+ * Command line
+ * ======================================================== */
+
+/* Is name in the comma separated list? */
+static int listed(const char *list, const char *name) {
+  size_t len = strlen(name);
+  for (const char *p = list; p != NULL; p = strchr(p, ',')) {
+    if (*p == ',') {
+      p++;
+    }
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-e engines] [-w workloads] [-t max_threads] "
+          "[-n ops_per_thread]\n", prog);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  const char *engine_list = "lock,nolock,system";
+  const char *workload_list = "tiny,mixed,large,powerlaw,larson,prodcons,"
+                              "xmalloc";
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = cpus > 0 ? cpus : 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "e:w:t:n:")) != -1) {
+    switch (opt) {
+    case 'e': engine_list = optarg; break;
+    case 'w': workload_list = optarg; break;
+    case 't': max_threads = atoi(optarg); break;
+    case 'n': ops_per_thread = strtoul(optarg, NULL, 0); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (max_threads < 1 || max_threads > MAX_THREADS || ops_per_thread == 0) {
+    usage(argv[0]);
+  }
+
+  printf("%-9s %-9s %7s %12s %8s %8s %8s %10s\n", "engine", "workload",
+         "threads", "ops/s", "p50(ns)", "p99(ns)", "p999(ns)", "rss(kB)");
+
+  size_t nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+  size_t nengines = sizeof(engines) / sizeof(engines[0]);
+  for (size_t w = 0; w < nworkloads; w++) {
+    const workload_t *workload = &workloads[w];
+    if (!listed(workload_list, workload->name)) {
+      continue;
+    }
+
+    /* 1, 2, 4, ... and the maximum itself */
+    int last = 0;
+    for (int threads = 1; ; threads *= 2) {
+      int n = threads < max_threads ? threads : max_threads;
+      if (workload->pairs) {
+        n = n < 2 ? 2 : n & ~1;
+      }
+      for (size_t e = 0; e < nengines && n != last; e++) {
+        if (!listed(engine_list, engines[e].name)) {
+          continue;
+        }
+        result_t r;
+        if (run_isolated(&engines[e], workload, n, &r)) {
+          printf("%-9s %-9s %7d %12.0f %8u %8u %8u %10ld\n", engines[e].name,
+                 workload->name, n, r.ops_per_sec, r.p50, r.p99, r.p999,
+                 r.peak_rss_kb);
+        } else {
+          printf("%-9s %-9s %7d   run failed\n", engines[e].name,
+                 workload->name, n);
+        }
+      }
+      last = n;
+      if (threads >= max_threads) {
+        break;
+      }
+    }
+  }
+
+  return 0;
+}
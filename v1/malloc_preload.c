@@ -0,0 +1,103 @@
+#include "my_malloc.h"
+
+#include <errno.h>
+
+/* ========================================================
+ * Standard allocation interface on top of the configured
+ * thread-safe version (see ts_malloc), for use with LD_PRELOAD:
+ *
+ *   LD_PRELOAD=./libmymalloc_preload.so TS_MALLOC_ENGINE=lock ./app
+ *
+ * TS_MALLOC_ENGINE picks the version (lock, nolock, tcache
+ * or lockfree; nolock by default).
+ * ======================================================== */
+
+/* malloc(0) must hand out a unique pointer that free() accepts */
+void *malloc(size_t size) {
+  void *ptr = ts_malloc(size != 0 ? size : 1);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+void free(void *ptr) {
+  if (ptr != NULL) {
+    ts_free(ptr);
+  }
+}
+
+/* C23: free with the size that was asked for */
+void free_sized(void *ptr, size_t size) {
+  ts_free_sized(ptr, size != 0 ? size : 1);
+}
+
+/* ts_calloc clears only memory it cannot know to be zero */
+void *calloc(size_t nmemb, size_t size) {
+  void *ptr = nmemb != 0 && size != 0 ? ts_calloc(nmemb, size)
+                                      : ts_calloc(1, 1);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return malloc(size);
+  }
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  void *new_ptr = ts_realloc(ptr, size);
+  if (new_ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return new_ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  void *ptr = ts_memalign(alignment, size != 0 ? size : 1);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  void *ptr = ts_aligned_alloc(alignment, size != 0 ? size : 1);
+  if (ptr == NULL) {
+    errno = alignment == 0 || (alignment & (alignment - 1)) != 0 ? EINVAL
+                                                                 : ENOMEM;
+  }
+  return ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  return ts_posix_memalign(memptr, alignment, size != 0 ? size : 1);
+}
+
+void *valloc(size_t size) {
+  return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+  return ts_malloc_usable_size(ptr);
+}
+
+/* The pad is ignored: only whole free pages are ever given back */
+int malloc_trim(size_t pad) {
+  (void)pad;
+  return ts_malloc_trim();
+}
@@ -1,207 +1,4135 @@
+#define _GNU_SOURCE  /* mremap, getcpu */
 #include "my_malloc.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unwind.h>
+
 /* ========================================================
  * Block metadata structure
- * Placed immediately before the user-visible memory region.
+ * A block is one 8-byte header word — the block's total size,
+ * which is a multiple of ALIGNMENT, and the BLOCK_* flags —
+ * followed by the user-visible memory region.  The owner heap
+ * is that of the block's chunk.  Only while the block is free
+ * does its region hold the bin links and, in its last word, a
+ * copy of the size (the footer boundary tag); the next block's
+ * BLOCK_PREV_ALLOC flag says whether that footer is there, so
+ * free can find both physical neighbours in O(1).
+ *
+ * Headers sit 8 bytes below an ALIGNMENT boundary, so every
+ * user pointer is 16-byte aligned.
+ *
+ * A free block carved from a fresh chunk, whose pages the
+ * kernel zero-filled, has BLOCK_ZERO set: all of its region
+ * but the bin links and the footer is still zero, so calloc
+ * need not clear it.  Any block that has been handed out, or
+ * merged with one that has, is cleared in full.
  * ======================================================== */
 typedef struct block {
-  size_t size;         /* usable size (bytes), excluding metadata */
+  size_t size;         /* total size (bytes) | BLOCK_* flags      */
+  struct block *prev;  /* pointer to prev block in free list      */
   struct block *next;  /* pointer to next block in free list      */
 } block_t;
 
-#define META_SIZE sizeof(block_t)
+#define BLOCK_ALLOC      1UL  /* in use (or cached), never coalesced */
+#define BLOCK_PREV_ALLOC 2UL  /* physically previous block in use    */
+#define BLOCK_ZERO       4UL  /* free, and zero but for links and tag */
+#define ALIGNMENT   16UL
+#define BLOCK_FLAGS (ALIGNMENT - 1)
+#define HEADER_SIZE sizeof(size_t)
+#define TAG_SIZE    sizeof(size_t)
+#define MIN_BLOCK   (sizeof(block_t) + TAG_SIZE)  /* room for a free block */
+#define MIN_SPLIT   (4 * MIN_BLOCK)  /* smallest remainder split off a block */
+#define FINE_CLASS_MAX 1024UL        /* sizes up to here are ALIGNMENT apart */
+
+/* Largest request we can round up without overflowing */
+#define MAX_REQUEST (SIZE_MAX / 2)
+
+#define ALIGN_UP(n)   (((n) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+#define ALIGN_DOWN(n) ((n) & ~(ALIGNMENT - 1))
+
+/* Metadata written by different threads is kept this far apart */
+#define CACHE_LINE 64
+
+/* ========================================================
+ * Statistics
+ * Each thread counts its calls, splits, coalesces and lock
+ * waits in a record of its own, with plain stores, so
+ * counting costs neither an atomic read-modify-write nor a
+ * shared cache line.  ts_malloc_stats() sums the records of
+ * all threads, plus what exited threads left behind, when it
+ * is asked; the rarer kernel calls are counted globally.
+ * Setting TS_MALLOC_STATS=1 prints the totals at exit.
+ * ======================================================== */
+enum stat_id {
+  STAT_MALLOCS,
+  STAT_FREES,
+  STAT_BYTES_ALLOCATED,
+  STAT_BYTES_FREED,
+  STAT_SPLITS,
+  STAT_COALESCES,
+  STAT_HEAP_WAITS,    /* contended heap mutex acquisitions   */
+  STAT_CHUNK_WAITS,   /* contended arena_mutex acquisitions  */
+  STAT_LOCK_TIMES,    /* TS_MALLOC_LOCK_BINS counts for each of
+                         heap wait, heap hold, chunk wait and
+                         chunk hold times, see "Locks" below   */
+  STAT_COUNT = STAT_LOCK_TIMES + 4 * TS_MALLOC_LOCK_BINS
+};
+
+typedef struct thread_stats {
+  size_t count[STAT_COUNT];
+  struct thread_stats *next;   /* on stats_threads or stats_spare */
+} __attribute__((aligned(CACHE_LINE))) thread_stats_t;
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_stats_t *stats_threads = NULL;  /* records of live threads */
+static thread_stats_t *stats_spare = NULL;    /* records ready for reuse */
+static thread_stats_t stats_retired;     /* counts of exited threads     */
+static thread_stats_t stats_shared;      /* for threads without a record */
+static __thread thread_stats_t *my_stats = NULL;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static size_t os_maps = 0;     /* mmap and mremap calls   */
+static size_t os_unmaps = 0;   /* munmap calls            */
+static size_t os_mapped = 0;   /* bytes currently mapped  */
+
+static void *base_alloc(size_t size);
+static size_t usable_size(void *ptr);
+
+/* Thread exit: fold the record into the retired counts and keep it */
+static void stats_retire(void *arg) {
+  thread_stats_t *stats = arg;
+  my_stats = NULL;
+
+  pthread_mutex_lock(&stats_mutex);
+  thread_stats_t **link = &stats_threads;
+  while (*link != stats) {
+    link = &(*link)->next;
+  }
+  *link = stats->next;
+  for (int i = 0; i < STAT_COUNT; i++) {
+    stats_retired.count[i] += stats->count[i];
+    stats->count[i] = 0;
+  }
+  stats->next = stats_spare;
+  stats_spare = stats;
+  pthread_mutex_unlock(&stats_mutex);
+}
+
+static void stats_key_create(void) {
+  pthread_key_create(&stats_key, stats_retire);
+}
+
+/* Give the calling thread a record; whatever it counts while getting
+ * one (a contended arena_mutex, say) goes to the shared record */
+static thread_stats_t *stats_attach(void) {
+  my_stats = &stats_shared;
+
+  pthread_mutex_lock(&stats_mutex);
+  thread_stats_t *stats = stats_spare;
+  if (stats != NULL) {
+    stats_spare = stats->next;
+  }
+  pthread_mutex_unlock(&stats_mutex);
+
+  if (stats == NULL && (stats = base_alloc(sizeof(*stats))) == NULL) {
+    return &stats_shared;
+  }
+
+  pthread_mutex_lock(&stats_mutex);
+  stats->next = stats_threads;
+  stats_threads = stats;
+  pthread_mutex_unlock(&stats_mutex);
+
+  pthread_once(&stats_once, stats_key_create);
+  pthread_setspecific(stats_key, stats);
+  my_stats = stats;
+  return stats;
+}
+
+static inline thread_stats_t *stats_self(void) {
+  return my_stats != NULL ? my_stats : stats_attach();
+}
+
+/* Only the owner writes a record; readers may see it mid-update */
+static inline void stat_add(enum stat_id stat, size_t n) {
+  thread_stats_t *stats = stats_self();
+  __atomic_store_n(&stats->count[stat], stats->count[stat] + n,
+                   __ATOMIC_RELAXED);
+}
 
 /* ========================================================
- * Helper: insert a freed block into a free list that is
- * kept sorted by address.  After insertion, coalesce with
- * the immediate neighbours if they are physically adjacent.
+ * Heap profile
+ * About once every prof_rate bytes allocated, the allocation
+ * that crosses the mark has its call stack recorded in a side
+ * table keyed by address, until it is freed.  The gaps are
+ * drawn from an exponential distribution, as pprof expects
+ * when it scales the samples back up.  With profiling off
+ * (prof_rate == 0, the default) allocation pays one branch
+ * and free one load.
+ *
+ * The rate may be set at build time with
+ * -DHEAP_PROFILE_RATE=<bytes> or at run time through
+ * TS_HEAP_PROFILE_RATE; TS_HEAP_PROFILE=<file> writes the
+ * profile of what is still live there at exit.
  * ======================================================== */
-static void insert_free_block(block_t **head, block_t *block) {
-  block_t *curr = *head;
-  block_t *prev = NULL;
+#ifndef HEAP_PROFILE_RATE
+#define HEAP_PROFILE_RATE 0
+#endif
+#define PROF_DEFAULT_RATE (512UL << 10)  /* if only a file is named */
+#define PROF_DEPTH        32             /* frames kept per sample  */
+#define PROF_BUCKETS      4096
+
+typedef struct sample {
+  void *ptr;
+  size_t size;
+  int depth;
+  void *stack[PROF_DEPTH];
+  struct sample *next;   /* in a bucket, or on prof_spare */
+} sample_t;
+
+static size_t prof_rate = HEAP_PROFILE_RATE;
+static pthread_mutex_t prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sample_t *prof_table[PROF_BUCKETS];
+static sample_t *prof_spare = NULL;
+static size_t prof_live = 0;               /* samples in prof_table */
+static __thread long prof_countdown = 0;   /* bytes to the next sample */
+static __thread uint64_t prof_rng = 0;
+static __thread int prof_busy = 0;         /* inside the profiler */
+
+__attribute__((constructor)) static void read_profile_config(void) {
+  const char *env = getenv("TS_HEAP_PROFILE_RATE");
+  if (env != NULL && *env != '\0') {
+    prof_rate = strtoul(env, NULL, 0);
+  } else if (getenv("TS_HEAP_PROFILE") != NULL) {
+    prof_rate = PROF_DEFAULT_RATE;
+  }
+}
+
+static inline size_t prof_bucket(void *ptr) {
+  return ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL >> 52;
+}
 
-  /* Walk the list to find the correct sorted position */
-  while (curr != NULL && curr < block) {
-    prev = curr;
-    curr = curr->next;
+/* Bytes to the next sample: -ln(U) * prof_rate, with U uniform in
+ * (0, 1] and log2 taken from the float exponent and a quadratic fit
+ * of the mantissa (within 0.5%) */
+static long prof_interval(void) {
+  if (prof_rng == 0) {
+    prof_rng = (uintptr_t)&prof_rng | 1;
   }
+  prof_rng ^= prof_rng << 13;
+  prof_rng ^= prof_rng >> 7;
+  prof_rng ^= prof_rng << 17;
 
-  /* Link the block into the list */
-  block->next = curr;
-  if (prev != NULL) {
-    prev->next = block;
+  uint64_t q = (prof_rng >> 11) + 1;   /* 1 .. 2^53 */
+  int msb = 63 - __builtin_clzl(q);
+  double f = (double)(q - (1UL << msb)) / (double)(1UL << msb);
+  double log2_q = msb + f * (1.3465 - 0.3465 * f);
+  return (long)((53 - log2_q) * 0.693147 * prof_rate) + 1;
+}
+
+/* The unwinder is called directly: backtrace() would dlopen it on
+ * first use, from inside malloc and perhaps inside the loader */
+typedef struct unwind_state {
+  void **stack;
+  int depth;
+  int skip;
+} unwind_state_t;
+
+static _Unwind_Reason_Code unwind_frame(struct _Unwind_Context *context,
+                                        void *arg) {
+  unwind_state_t *state = arg;
+  void *ip = (void *)_Unwind_GetIP(context);
+  if (ip == NULL || state->depth == PROF_DEPTH) {
+    return _URC_END_OF_STACK;
+  }
+  if (state->skip > 0) {
+    state->skip--;
   } else {
-    *head = block;
+    state->stack[state->depth++] = ip;
+  }
+  return _URC_NO_REASON;
+}
+
+/* Record ptr's call stack if its bytes cross the next sample mark;
+ * the profiler's own allocations are not recorded, but still move the
+ * mark on so the gaps keep their distribution */
+static void prof_sample(void *ptr, size_t size) {
+  if (prof_busy) {
+    prof_countdown = prof_interval();
+    return;
+  }
+  prof_busy = 1;
+
+  /* A thread's first mark is only drawn, not sampled */
+  int first = prof_rng == 0;
+  prof_countdown = prof_interval();
+  if (first) {
+    prof_busy = 0;
+    return;
+  }
+
+  pthread_mutex_lock(&prof_mutex);
+  sample_t *sample = prof_spare;
+  if (sample != NULL) {
+    prof_spare = sample->next;
+  }
+  pthread_mutex_unlock(&prof_mutex);
+  if (sample == NULL && (sample = base_alloc(sizeof(*sample))) == NULL) {
+    prof_busy = 0;
+    return;
+  }
+
+  /* The profiler's own frame is left out */
+  unwind_state_t state = { sample->stack, 0, 1 };
+  _Unwind_Backtrace(unwind_frame, &state);
+  sample->ptr = ptr;
+  sample->size = size;
+  sample->depth = state.depth;
+
+  size_t idx = prof_bucket(ptr);
+  pthread_mutex_lock(&prof_mutex);
+  sample->next = prof_table[idx];
+  __atomic_store_n(&prof_table[idx], sample, __ATOMIC_RELEASE);
+  __atomic_store_n(&prof_live, prof_live + 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&prof_mutex);
+  prof_busy = 0;
+}
+
+/* Find ptr's sample and unlink it if remove is set; an empty bucket,
+ * by far the common case, is seen without taking the lock */
+static sample_t *prof_find(void *ptr, int remove) {
+  size_t idx = prof_bucket(ptr);
+  if (__atomic_load_n(&prof_table[idx], __ATOMIC_RELAXED) == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&prof_mutex);
+  sample_t **link = &prof_table[idx];
+  while (*link != NULL && (*link)->ptr != ptr) {
+    link = &(*link)->next;
+  }
+  sample_t *sample = *link;
+  if (sample != NULL && remove) {
+    *link = sample->next;
+    sample->next = prof_spare;
+    prof_spare = sample;
+    __atomic_store_n(&prof_live, prof_live - 1, __ATOMIC_RELAXED);
   }
+  pthread_mutex_unlock(&prof_mutex);
+  return sample;
+}
+
+/* Count a block the caller is about to hand out */
+static inline void *stat_alloc(void *ptr) {
+  if (ptr != NULL) {
+    size_t size = usable_size(ptr);
+    stat_add(STAT_MALLOCS, 1);
+    stat_add(STAT_BYTES_ALLOCATED, size);
+    if (prof_rate != 0 && (prof_countdown -= size) <= 0) {
+      prof_sample(ptr, size);
+    }
+  }
+  return ptr;
+}
+
+/* Count a block of size usable bytes the caller is about to free */
+static inline void stat_free_size(void *ptr, size_t size) {
+  stat_add(STAT_FREES, 1);
+  stat_add(STAT_BYTES_FREED, size);
+  if (__atomic_load_n(&prof_live, __ATOMIC_RELAXED) != 0 && !prof_busy) {
+    prof_find(ptr, 1);
+  }
+}
 
-  /* Coalesce with the NEXT free block if adjacent */
-  if (block->next != NULL &&
-      (char *)block + META_SIZE + block->size == (char *)block->next) {
-    block->size += META_SIZE + block->next->size;
-    block->next = block->next->next;
+/* Count a block the caller is about to free; before it is freed */
+static inline void stat_free(void *ptr) {
+  stat_free_size(ptr, usable_size(ptr));
+}
+
+/* Count a block resized in place from old_size usable bytes; a
+ * sampled block keeps its call stack */
+static inline void stat_resize(void *ptr, size_t old_size) {
+  size_t size = usable_size(ptr);
+  stat_add(STAT_BYTES_FREED, old_size);
+  stat_add(STAT_BYTES_ALLOCATED, size);
+  if (__atomic_load_n(&prof_live, __ATOMIC_RELAXED) != 0 && !prof_busy) {
+    sample_t *sample = prof_find(ptr, 0);
+    if (sample != NULL) {
+      sample->size = size;
+    }
+  }
+}
+
+static void stat_alloc_batch(void **ptrs, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    stat_alloc(ptrs[i]);
   }
+}
 
-  /* Coalesce with the PREVIOUS free block if adjacent */
-  if (prev != NULL &&
-      (char *)prev + META_SIZE + prev->size == (char *)block) {
-    prev->size += META_SIZE + block->size;
-    prev->next = block->next;
+static void stat_free_batch(void **ptrs, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (ptrs[i] != NULL) {
+      stat_free(ptrs[i]);
+    }
   }
 }
 
+/* Count kernel calls that map or unmap memory, and the bytes moved */
+static inline void stat_os(size_t maps, size_t unmaps, size_t mapped) {
+  __atomic_fetch_add(&os_maps, maps, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&os_unmaps, unmaps, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&os_mapped, mapped, __ATOMIC_RELAXED);
+}
+
 /* ========================================================
- * Helper: best-fit search on the given free list.
- * Finds the smallest block whose size >= requested size,
- * removes it from the list, and splits it if the remainder
- * is large enough for another allocation.
- * Returns NULL if no suitable block is found.
+ * Locks
+ * The heap locks of the locking and tcache versions and the
+ * arena_mutex guarding chunk refills are ts_lock_t, of one
+ * kind for the whole process, set at build time with
+ * -DLOCK_KIND=<0..3> or at run time with
+ * TS_LOCK=mutex|spin|ticket|mcs:
+ *   mutex   a pthread mutex, which parks waiters at once
+ *   spin    test-and-set, retried with exponential backoff
+ *           for LOCK_SPINS rounds before parking on a futex
+ *   ticket  first come, first served; a waiter backs off in
+ *           proportion to the tickets ahead of it
+ *   mcs     a queue of per-thread nodes, each waiter spinning
+ *           on a cache line of its own
+ * Spinning waiters yield the CPU now and then, so a holder
+ * that was preempted gets to run.  With TS_LOCK_PROFILE=1
+ * every acquisition records in power-of-two histograms how
+ * many nanoseconds it waited and then held the lock.
+ * The kind and profiling are read on the first lock taken,
+ * and never change after that.
  * ======================================================== */
-static block_t *best_fit_search(block_t **head, size_t size) {
-  block_t *curr = *head;
-  block_t *prev = NULL;
-  block_t *best = NULL;
-  block_t *best_prev = NULL;
+#define LOCK_MUTEX  0
+#define LOCK_SPIN   1
+#define LOCK_TICKET 2
+#define LOCK_MCS    3
 
-  /* Scan the entire free list for the best (smallest) fit */
-  while (curr != NULL) {
-    if (curr->size >= size) {
-      if (best == NULL || curr->size < best->size) {
-        best = curr;
-        best_prev = prev;
+#ifndef LOCK_KIND
+#define LOCK_KIND LOCK_MUTEX
+#endif
+
+#define LOCK_SPINS       10   /* spin lock rounds before parking     */
+#define LOCK_BACKOFF_MAX 8    /* longest backoff is 2^8 pauses       */
+#define LOCK_YIELD       16   /* rounds before waiters start to yield */
+#define LOCK_NODES       4    /* MCS locks one thread may hold       */
+#define LOCK_FORK_NODES  72   /* MCS locks fork() holds, see "Fork"  */
+
+enum lock_class {
+  LOCK_HEAP,    /* zero, so zeroed locks are heap locks */
+  LOCK_CHUNK
+};
+
+typedef struct lock_node {
+  struct lock_node *next;   /* waiter queued behind this one */
+  int waiting;              /* spun on until the lock is handed over */
+  int busy;                 /* in use by one of our locks */
+} __attribute__((aligned(CACHE_LINE))) lock_node_t;
+
+typedef struct ts_lock {
+  pthread_mutex_t mutex;      /* mutex                              */
+  unsigned word;              /* spin: 0 free, 1 held, 2 contended  */
+  unsigned ticket;            /* ticket: next ticket handed out     */
+  unsigned serving;           /* ticket: ticket holding the lock    */
+  lock_node_t *tail;          /* mcs: last node in the queue        */
+  lock_node_t *owner;         /* mcs: node of the holder            */
+  enum lock_class cls;
+  uint64_t since;             /* when the holder got it, if timed   */
+} ts_lock_t;
+
+#define LOCK_INITIALIZER(c) { .mutex = PTHREAD_MUTEX_INITIALIZER, .cls = (c) }
+
+static int lock_kind = -1;       /* LOCK_*, or -1 until configured */
+static int lock_profile = 0;
+static __thread lock_node_t lock_nodes[LOCK_NODES];
+static lock_node_t lock_fork_nodes[LOCK_FORK_NODES];
+static __thread int lock_forking = 0;   /* taking every lock for fork() */
+
+static void lock_configure(void) {
+  int kind = LOCK_KIND;
+  const char *env = getenv("TS_LOCK");
+  if (env != NULL && *env != '\0') {
+    if (strcmp(env, "spin") == 0) {
+      kind = LOCK_SPIN;
+    } else if (strcmp(env, "ticket") == 0) {
+      kind = LOCK_TICKET;
+    } else if (strcmp(env, "mcs") == 0) {
+      kind = LOCK_MCS;
+    } else {
+      kind = LOCK_MUTEX;
+    }
+  }
+  env = getenv("TS_LOCK_PROFILE");
+  lock_profile = env != NULL && *env != '\0' && strcmp(env, "0") != 0;
+  __atomic_store_n(&lock_kind, kind, __ATOMIC_RELEASE);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/* Wait a little longer each round, and let others run once spinning
+ * has gone on for a while */
+static void lock_backoff(unsigned round) {
+  unsigned shift = round < LOCK_BACKOFF_MAX ? round : LOCK_BACKOFF_MAX;
+  for (unsigned i = 0; i < 1U << shift; i++) {
+    cpu_relax();
+  }
+  if (round >= LOCK_YIELD) {
+    sched_yield();
+  }
+}
+
+static inline uint64_t lock_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Count ns in bin 64 - clz(ns) of the given histogram, without
+ * attaching a record: the caller may hold the chunk lock */
+static void lock_record(ts_lock_t *lock, int hold, uint64_t ns) {
+  thread_stats_t *stats = my_stats != NULL ? my_stats : &stats_shared;
+  unsigned bin = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+  if (bin >= TS_MALLOC_LOCK_BINS) {
+    bin = TS_MALLOC_LOCK_BINS - 1;
+  }
+  size_t *count = &stats->count[STAT_LOCK_TIMES +
+                                (2 * lock->cls + hold) * TS_MALLOC_LOCK_BINS +
+                                bin];
+  __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+static lock_node_t *lock_node_get(void) {
+  lock_node_t *nodes = lock_forking ? lock_fork_nodes : lock_nodes;
+  int count = lock_forking ? LOCK_FORK_NODES : LOCK_NODES;
+  for (int i = 0; i < count; i++) {
+    if (!nodes[i].busy) {
+      nodes[i].busy = 1;
+      nodes[i].next = NULL;
+      nodes[i].waiting = 1;
+      return &nodes[i];
+    }
+  }
+  abort();   /* nesting deeper than this is a bug */
+}
+
+/* Take the lock if it is free */
+static int lock_attempt(ts_lock_t *lock, int kind) {
+  switch (kind) {
+  case LOCK_SPIN: {
+    unsigned expected = 0;
+    return __atomic_compare_exchange_n(&lock->word, &expected, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+  }
+  case LOCK_TICKET: {
+    unsigned serving = __atomic_load_n(&lock->serving, __ATOMIC_RELAXED);
+    unsigned expected = serving;
+    return __atomic_compare_exchange_n(&lock->ticket, &expected, serving + 1,
+                                       0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+  }
+  case LOCK_MCS: {
+    lock_node_t *node = lock_node_get();
+    lock_node_t *expected = NULL;
+    if (__atomic_compare_exchange_n(&lock->tail, &expected, node, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      lock->owner = node;
+      return 1;
+    }
+    node->busy = 0;
+    return 0;
+  }
+  default:
+    return pthread_mutex_trylock(&lock->mutex) == 0;
+  }
+}
+
+/* Wait for the lock */
+static void lock_wait(ts_lock_t *lock, int kind) {
+  switch (kind) {
+  case LOCK_SPIN:
+    for (unsigned round = 0; round < LOCK_SPINS; round++) {
+      lock_backoff(round);
+      if (__atomic_load_n(&lock->word, __ATOMIC_RELAXED) == 0 &&
+          lock_attempt(lock, kind)) {
+        return;
       }
-      /* Perfect fit — no need to keep searching */
-      if (best->size == size) {
-        break;
+    }
+    /* Mark the lock contended, so its release wakes us */
+    while (__atomic_exchange_n(&lock->word, 2, __ATOMIC_ACQUIRE) != 0) {
+      syscall(SYS_futex, &lock->word, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    }
+    return;
+  case LOCK_TICKET: {
+    unsigned me = __atomic_fetch_add(&lock->ticket, 1, __ATOMIC_RELAXED);
+    unsigned serving, round = 0;
+    while ((serving = __atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE)) !=
+           me) {
+      for (unsigned i = 0; i < me - serving; i++) {
+        lock_backoff(0);
+      }
+      if (++round >= LOCK_YIELD) {
+        sched_yield();
+      }
+    }
+    return;
+  }
+  case LOCK_MCS: {
+    lock_node_t *node = lock_node_get();
+    lock_node_t *prev = __atomic_exchange_n(&lock->tail, node,
+                                            __ATOMIC_ACQ_REL);
+    if (prev != NULL) {
+      __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+      for (unsigned round = 0;
+           __atomic_load_n(&node->waiting, __ATOMIC_ACQUIRE); round++) {
+        lock_backoff(round);
       }
     }
-    prev = curr;
-    curr = curr->next;
+    lock->owner = node;
+    return;
+  }
+  default:
+    pthread_mutex_lock(&lock->mutex);
   }
+}
 
-  if (best == NULL) {
-    return NULL;
+/* Take a lock, counting the times it had to be waited for */
+static void lock_acquire(ts_lock_t *lock) {
+  int kind = __atomic_load_n(&lock_kind, __ATOMIC_ACQUIRE);
+  if (kind < 0) {
+    lock_configure();
+    kind = lock_kind;
   }
 
-  /* Remove the chosen block from the free list */
-  if (best_prev != NULL) {
-    best_prev->next = best->next;
-  } else {
-    *head = best->next;
+  /* Getting a record may take arena_mutex: not while holding it */
+  uint64_t start = 0;
+  if (lock_profile) {
+    stats_self();
+    start = lock_clock();
+  }
+  if (!lock_attempt(lock, kind)) {
+    stat_add(STAT_HEAP_WAITS + lock->cls, 1);
+    lock_wait(lock, kind);
+  }
+  if (lock_profile) {
+    lock->since = lock_clock();
+    lock_record(lock, 0, lock->since - start);
   }
-  best->next = NULL;
+}
 
-  /* Split if the remainder can hold at least 1 byte of user data */
-  if (best->size >= size + META_SIZE + 1) {
-    block_t *remainder =
-        (block_t *)((char *)best + META_SIZE + size);
-    remainder->size = best->size - size - META_SIZE;
-    remainder->next = NULL;
-    best->size = size;
-    insert_free_block(head, remainder);
+/* Take a lock only if nobody holds it; 1 if we got it */
+static int lock_try(ts_lock_t *lock) {
+  int kind = __atomic_load_n(&lock_kind, __ATOMIC_ACQUIRE);
+  if (kind < 0) {
+    lock_configure();
+    kind = lock_kind;
   }
 
-  return best;
+  if (lock_profile) {
+    stats_self();
+  }
+  if (!lock_attempt(lock, kind)) {
+    return 0;
+  }
+  if (lock_profile) {
+    lock->since = lock_clock();
+    lock_record(lock, 0, 0);
+  }
+  return 1;
 }
 
-/* ================================================================
- * VERSION 1 — Lock-based thread-safe malloc / free
+static void lock_release(ts_lock_t *lock) {
+  if (lock_profile) {
+    lock_record(lock, 1, lock_clock() - lock->since);
+  }
+
+  switch (lock_kind) {
+  case LOCK_SPIN:
+    if (__atomic_exchange_n(&lock->word, 0, __ATOMIC_RELEASE) == 2) {
+      syscall(SYS_futex, &lock->word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+    return;
+  case LOCK_TICKET:
+    __atomic_store_n(&lock->serving, lock->serving + 1, __ATOMIC_RELEASE);
+    return;
+  case LOCK_MCS: {
+    lock_node_t *node = lock->owner;
+    lock_node_t *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) {
+      lock_node_t *expected = node;
+      if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        node->busy = 0;
+        return;
+      }
+      /* A waiter swapped itself in and is about to link up */
+      while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL) {
+        cpu_relax();
+      }
+    }
+    __atomic_store_n(&next->waiting, 0, __ATOMIC_RELEASE);
+    node->busy = 0;
+    return;
+  }
+  default:
+    pthread_mutex_unlock(&lock->mutex);
+  }
+}
+
+/* Only for a fork() child, where the lock's other waiters are gone:
+ * releasing would hand a ticket or MCS lock over to one of them */
+static void lock_reset(ts_lock_t *lock) {
+  *lock = (ts_lock_t)LOCK_INITIALIZER(lock->cls);
+}
+
+/* ========================================================
+ * Hardening
+ * In hardened mode the upper half of every block header,
+ * unused since no block reaches 4 GiB, holds a canary: a
+ * hash of the block's address and the lower half, keyed by
+ * a random secret.  A header that was overwritten, or a
+ * pointer that never was a block, fails the check.  Memory
+ * that has been freed but still looks in use — in a fast
+ * bin, a thread cache, a slab, a lock-free pool or on its
+ * way back to another thread — carries a random key in one
+ * of its first two words instead, so freeing it again is
+ * caught too.  Frees also check that the pointer's chunk
+ * belongs to the freeing version and that bin links agree
+ * before unlinking, and every purge walks the free lists
+ * the way ts_malloc_check() does, leaving the search for
+ * overlapping blocks to it.  A failed check prints what it
+ * found and aborts.
  *
- * Strategy: a single global free list protected by one mutex.
- * Every call to ts_malloc_lock / ts_free_lock acquires the mutex,
- * which serializes all heap operations across threads.
- * ================================================================ */
+ * The mode is set at build time with -DHARDENED=1 or at run
+ * time through TS_HARDENED=1, and read when the first chunk
+ * is mapped, before any header exists.
+ * ======================================================== */
+#ifndef HARDENED
+#define HARDENED 0
+#endif
 
-static block_t *lock_free_list = NULL;
-static pthread_mutex_t lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define HEADER_LOW      0xffffffffUL                /* below the canary */
+#define BLOCK_SIZE_MASK (HEADER_LOW & ~BLOCK_FLAGS)
 
-void *ts_malloc_lock(size_t size) {
-  if (size == 0) {
-    return NULL;
+static int hardened = -1;         /* 1 if on, or -1 until configured */
+static size_t harden_secret = 1;  /* odd multiplier for the canaries */
+static size_t harden_key = 0;     /* marks memory freed but in use   */
+
+static void harden_configure(void) {
+  int on = HARDENED;
+  const char *env = getenv("TS_HARDENED");
+  if (env != NULL && *env != '\0') {
+    on = strcmp(env, "0") != 0;
+  }
+
+  size_t seed[2];
+  if (on && syscall(SYS_getrandom, seed, sizeof(seed), 0) != sizeof(seed)) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    seed[0] = (size_t)ts.tv_nsec * 0x9e3779b97f4a7c15UL ^ (uintptr_t)&ts;
+    seed[1] = (size_t)ts.tv_sec * 0xbf58476d1ce4e5b9UL ^ (size_t)getpid();
+  }
+  if (on) {
+    harden_secret = seed[0] | 1;
+    harden_key = seed[1] | 1;
   }
+  __atomic_store_n(&hardened, on, __ATOMIC_RELEASE);
+}
 
-  pthread_mutex_lock(&lock_mutex);
+static inline int harden_on(void) {
+  return __atomic_load_n(&hardened, __ATOMIC_RELAXED) > 0;
+}
 
-  /* Try to satisfy the request from the free list */
-  block_t *block = best_fit_search(&lock_free_list, size);
+static void harden_report(const char *what, const void *ptr) {
+  fprintf(stderr, "ts_malloc: %s at %p\n", what, ptr);
+}
 
-  if (block != NULL) {
-    pthread_mutex_unlock(&lock_mutex);
-    return (void *)(block + 1);
+static void harden_fail(const char *what, const void *ptr) {
+  harden_report(what, ptr);
+  abort();
+}
+
+/* The upper half of a header for the given lower half */
+static inline size_t header_canary(const block_t *block, size_t low) {
+  return (((uintptr_t)block ^ low) * harden_secret) & ~HEADER_LOW;
+}
+
+/* Objects linked through their first word keep the key in the second */
+static inline void mark_freed(void *ptr) {
+  if (harden_on()) {
+    ((size_t *)ptr)[1] = harden_key;
   }
+}
 
-  /* No suitable free block — grow the heap */
-  block = sbrk(META_SIZE + size);
-  if (block == (void *)-1) {
-    pthread_mutex_unlock(&lock_mutex);
-    return NULL;
+static inline void unmark_freed(void *ptr) {
+  if (harden_on()) {
+    ((size_t *)ptr)[1] = 0;
   }
+}
 
-  block->size = size;
-  block->next = NULL;
+static inline int is_freed(const void *ptr) {
+  const size_t *word = ptr;
+  return word[0] == harden_key || word[1] == harden_key;
+}
 
-  pthread_mutex_unlock(&lock_mutex);
-  return (void *)(block + 1);
+/* ========================================================
+ * Boundary tag helpers
+ * Tags are only written by whoever may modify the owning
+ * heap, but the tcache version reads the header of a block
+ * it holds without the lock while a neighbour's free flips
+ * its BLOCK_PREV_ALLOC flag, so header words are accessed
+ * atomically (plain moves on x86).
+ * ======================================================== */
+static inline size_t block_header(const block_t *block) {
+  return __atomic_load_n(&block->size, __ATOMIC_RELAXED);
 }
 
-void ts_free_lock(void *ptr) {
-  if (ptr == NULL) {
-    return;
+static inline void set_header(block_t *block, size_t header) {
+  if (harden_on()) {
+    header &= HEADER_LOW;
+    header |= header_canary(block, header);
   }
+  __atomic_store_n(&block->size, header, __ATOMIC_RELAXED);
+}
 
-  block_t *block = (block_t *)ptr - 1;
+static inline size_t block_size(const block_t *block) {
+  return block_header(block) & BLOCK_SIZE_MASK;
+}
 
-  pthread_mutex_lock(&lock_mutex);
-  insert_free_block(&lock_free_list, block);
-  pthread_mutex_unlock(&lock_mutex);
+/* Hardened mode: abort unless the header's canary is intact */
+static inline void check_header(const block_t *block) {
+  if (harden_on()) {
+    size_t header = block_header(block);
+    if ((header & ~HEADER_LOW) != header_canary(block, header & HEADER_LOW)) {
+      harden_fail("corrupted block header", (char *)block + HEADER_SIZE);
+    }
+  }
 }
 
-/* ================================================================
- * VERSION 2 — Non-locking thread-safe malloc / free
- *
- * Strategy: each thread maintains its own free list via
- * Thread-Local Storage (__thread).  No lock is needed when
- * accessing the per-thread free list.
- *
- * The only lock is around sbrk(), which is not thread-safe.
- * ================================================================ */
+static inline void *block_data(block_t *block) {
+  return (char *)block + HEADER_SIZE;
+}
 
-static __thread block_t *nolock_free_list = NULL;
-static pthread_mutex_t sbrk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static inline block_t *data_block(void *ptr) {
+  return (block_t *)((char *)ptr - HEADER_SIZE);
+}
 
-void *ts_malloc_nolock(size_t size) {
-  if (size == 0) {
-    return NULL;
+static inline block_t *next_block(block_t *block) {
+  return (block_t *)((char *)block + block_size(block));
+}
+
+/* ========================================================
+ * Helper: total size of a block that can hold size bytes.
+ * Requests are rounded to a size class first: ALIGNMENT
+ * apart up to FINE_CLASS_MAX, four per power of two above
+ * (at most 25% slack).  Blocks of a handful of sizes keep
+ * fitting each other's holes exactly instead of leaving
+ * slivers behind.
+ * ======================================================== */
+static inline size_t request_size(size_t size) {
+  if (size > FINE_CLASS_MAX) {
+    size_t step = 1UL << (61 - __builtin_clzl(size - 1));
+    size = (size + step - 1) & ~(step - 1);
   }
+  size = ALIGN_UP(size + HEADER_SIZE);
+  return size > MIN_BLOCK ? size : MIN_BLOCK;
+}
 
-  /* Search the thread-local free list (no lock needed) */
-  block_t *block = best_fit_search(&nolock_free_list, size);
+/* Mark a block in use, keeping its BLOCK_PREV_ALLOC flag */
+static void set_alloc(block_t *block, size_t size) {
+  set_header(block, size | BLOCK_ALLOC |
+                    (block_header(block) & BLOCK_PREV_ALLOC));
+  block_t *next = next_block(block);
+  set_header(next, block_header(next) | BLOCK_PREV_ALLOC);
+}
 
-  if (block != NULL) {
-    return (void *)(block + 1);
-  }
+/* Mark a block free; the block before a free block is always in use */
+static void set_free(block_t *block, size_t size) {
+  set_header(block, size | BLOCK_PREV_ALLOC);
+  *(size_t *)((char *)block + size - TAG_SIZE) = size;
+  block_t *next = next_block(block);
+  set_header(next, block_header(next) & ~BLOCK_PREV_ALLOC);
+}
 
-  /* No suitable free block — grow the heap (lock only around sbrk) */
-  pthread_mutex_lock(&sbrk_mutex);
-  block = sbrk(META_SIZE + size);
-  pthread_mutex_unlock(&sbrk_mutex);
+/* Physically next block, if it is free */
+static block_t *free_next(block_t *block) {
+  block_t *next = next_block(block);
+  check_header(next);
+  return (block_header(next) & BLOCK_ALLOC) ? NULL : next;
+}
 
-  if (block == (void *)-1) {
+/* Physically previous block, if it is free */
+static block_t *free_prev(block_t *block) {
+  if (block_header(block) & BLOCK_PREV_ALLOC) {
     return NULL;
   }
+  size_t footer = ((size_t *)block)[-1];
+  block_t *prev = (block_t *)((char *)block - footer);
+  if (harden_on()) {
+    check_header(prev);
+    if (block_size(prev) != footer || (block_header(prev) & BLOCK_ALLOC)) {
+      harden_fail("corrupted boundary tag", block_data(block));
+    }
+  }
+  return prev;
+}
+
+/* ========================================================
+ * Segregated free lists
+ * Free blocks are binned by size class: two bins per power
+ * of two, so every block in bin i is within a factor of 1.5
+ * of every other.  Each bin is a doubly linked list and a
+ * bitmap records which bins are non-empty, so malloc only
+ * scans its own bin and otherwise jumps straight to the
+ * next populated one.
+ *
+ * A heap fills whole cache lines, and the remote-free stack
+ * that other threads push onto has a line of its own, so
+ * neither a neighbouring heap nor a remote free disturbs the
+ * lines its owner works on.
+ * ======================================================== */
+#define NUM_BINS 64
+
+#define SLAB_QUANTUM 16                            /* object size spacing */
+#define SLAB_CLASSES 16                            /* 16 .. 256 bytes     */
+#define SLAB_MAX     (SLAB_QUANTUM * SLAB_CLASSES)
+
+#define FAST_MAX  (FINE_CLASS_MAX + ALIGNMENT)  /* largest fast block */
+#define NUM_FAST  (FAST_MAX / ALIGNMENT + 1)
+
+typedef struct heap {
+  block_t *bins[NUM_BINS];  /* doubly linked free list per class */
+  unsigned long binmap;     /* bit i set <=> bins[i] non-empty   */
+  block_t *fast[NUM_FAST];  /* uncoalesced frees, by size / 16   */
+  size_t fast_bytes;        /* bytes held in fast[]              */
+  struct slab *slabs[SLAB_CLASSES];  /* slabs with free objects  */
+  struct slab_chunk *slab_chunk;     /* chunk slabs are cut from */
+  size_t freed;             /* bytes freed since the last purge  */
+  unsigned long numa_mask;  /* nodes backing new chunks; 0: any  */
+  unsigned long trim_epoch; /* last ts_malloc_trim() honoured    */
+  struct heap *next_orphan; /* next heap of an exited thread     */
+  int nolock;               /* a nolock thread's heap            */
+
+  /* memory freed by other threads */
+  void *remote_frees __attribute__((aligned(CACHE_LINE)));
+} __attribute__((aligned(CACHE_LINE))) heap_t;
+
+static size_t bin_index(size_t size) {
+  size_t msb = 63 - __builtin_clzl(size);
+  size_t idx = msb * 2 + (msb > 0 ? (size >> (msb - 1)) & 1 : 0);
+  return idx < NUM_BINS ? idx : NUM_BINS - 1;
+}
+
+static void bin_push(heap_t *heap, block_t *block) {
+  size_t idx = bin_index(block_size(block));
+  block->prev = NULL;
+  block->next = heap->bins[idx];
+  if (block->next != NULL) {
+    block->next->prev = block;
+  }
+  heap->bins[idx] = block;
+  heap->binmap |= 1UL << idx;
+}
 
-  block->size = size;
+static void bin_remove(heap_t *heap, block_t *block) {
+  size_t idx = bin_index(block_size(block));
+  if (harden_on()) {
+    check_header(block);
+    if ((block->prev != NULL ? block->prev->next : heap->bins[idx]) != block ||
+        (block->next != NULL && block->next->prev != block)) {
+      harden_fail("corrupted free list", block_data(block));
+    }
+  }
+  if (block->prev != NULL) {
+    block->prev->next = block->next;
+  } else {
+    heap->bins[idx] = block->next;
+  }
+  if (block->next != NULL) {
+    block->next->prev = block->prev;
+  }
+  if (heap->bins[idx] == NULL) {
+    heap->binmap &= ~(1UL << idx);
+  }
+  block->prev = NULL;
   block->next = NULL;
+}
+
+/* ========================================================
+ * Helper: return a block to the given heap.  Its physical
+ * neighbours are found through the boundary tags and, if
+ * they are free, coalesced with it before the result is
+ * pushed onto its size-class bin.
+ * ======================================================== */
+static void insert_free_block(heap_t *heap, block_t *block) {
+  size_t size = block_size(block);
+  block_t *neighbour;
+
+  /* Coalesce with the NEXT physical block if it is free */
+  if ((neighbour = free_next(block)) != NULL) {
+    bin_remove(heap, neighbour);
+    size += block_size(neighbour);
+    stat_add(STAT_COALESCES, 1);
+  }
+
+  /* Coalesce with the PREVIOUS physical block if it is free */
+  if ((neighbour = free_prev(block)) != NULL) {
+    bin_remove(heap, neighbour);
+    size += block_size(neighbour);
+    if (harden_on()) {
+      set_header(block, 0);   /* freeing it again finds it free */
+    }
+    block = neighbour;
+    stat_add(STAT_COALESCES, 1);
+  }
 
-  return (void *)(block + 1);
+  set_free(block, size);
+  bin_push(heap, block);
 }
 
-void ts_free_nolock(void *ptr) {
-  if (ptr == NULL) {
-    return;
+/* ========================================================
+ * Helper: mark a block allocated with the given total size,
+ * and free whatever is left over if it is at least
+ * MIN_SPLIT bytes.  Anything smaller could hardly serve a
+ * later request and would only lengthen the bins, so it
+ * stays part of the allocated block.
+ * Returns 1 if the block had BLOCK_ZERO set.
+ * ======================================================== */
+static int split_block(heap_t *heap, block_t *block, size_t size) {
+  size_t total = block_size(block);
+  int zero = (block_header(block) & BLOCK_ZERO) != 0;
+  if (total >= size + MIN_SPLIT) {
+    set_header(block, size | BLOCK_ALLOC |
+                      (block_header(block) & BLOCK_PREV_ALLOC));
+    block_t *remainder = next_block(block);
+    set_header(remainder, (total - size) | BLOCK_ALLOC | BLOCK_PREV_ALLOC);
+    insert_free_block(heap, remainder);
+    stat_add(STAT_SPLITS, 1);
+
+    /* A remainder that merged with nothing is as zero as the block was */
+    if (zero && block_size(remainder) == total - size) {
+      set_header(remainder, block_header(remainder) | BLOCK_ZERO);
+    }
+  } else {
+    set_alloc(block, total);
   }
+  return zero;
+}
+
+/* ========================================================
+ * Helper: segregated-fit search on the given heap for a
+ * block of the given total size.
+ * The request's own bin may hold blocks that are too small,
+ * so it is scanned for the best (smallest) fit.  Failing
+ * that, every block in a higher bin fits, and the first
+ * block of the lowest populated one is taken.  The chosen
+ * block is split if the remainder is large enough for
+ * another allocation.
+ * Returns NULL if no suitable block is found.
+ * ======================================================== */
 
-  block_t *block = (block_t *)ptr - 1;
+/* The chosen block, taken out of its bin but not yet split */
+static block_t *bin_take(heap_t *heap, size_t size) {
+  size_t idx = bin_index(size);
+  block_t *best = NULL;
 
-  /* Insert into the CALLING thread's local free list (no lock needed) */
-  insert_free_block(&nolock_free_list, block);
+  /* Scan the request's own bin for the best (smallest) fit */
+  for (block_t *curr = heap->bins[idx]; curr != NULL; curr = curr->next) {
+    if (block_size(curr) >= size) {
+      if (best == NULL || block_size(curr) < block_size(best)) {
+        best = curr;
+      }
+      /* Perfect fit — no need to keep searching */
+      if (block_size(best) == size) {
+        break;
+      }
+    }
+  }
+
+  /* Otherwise take the head of the next non-empty bin */
+  if (best == NULL && idx < NUM_BINS - 1) {
+    unsigned long higher = heap->binmap & ~((2UL << idx) - 1);
+    if (higher == 0) {
+      return NULL;
+    }
+    best = heap->bins[__builtin_ctzl(higher)];
+  }
+
+  if (best == NULL) {
+    return NULL;
+  }
+
+  /* Remove the chosen block from its bin */
+  bin_remove(heap, best);
+  return best;
+}
+
+static block_t *best_fit_search(heap_t *heap, size_t size) {
+  block_t *block = bin_take(heap, size);
+  if (block != NULL) {
+    split_block(heap, block, size);
+  }
+  return block;
+}
+
+/* ========================================================
+ * Helper: resize an allocated block in place to the given
+ * total size.  Shrinking splits the tail off; growing
+ * absorbs the physically next block if it is free and big
+ * enough.
+ * Returns 0 if the block has to move.
+ * ======================================================== */
+static int resize_block(heap_t *heap, block_t *block, size_t size) {
+  if (size <= block_size(block)) {
+    split_block(heap, block, size);
+    return 1;
+  }
+
+  block_t *next = free_next(block);
+  if (next == NULL || block_size(block) + block_size(next) < size) {
+    return 0;
+  }
+
+  bin_remove(heap, next);
+  set_header(block, (block_size(block) + block_size(next)) | BLOCK_ALLOC |
+                    (block_header(block) & BLOCK_PREV_ALLOC));
+  split_block(heap, block, size);
+  return 1;
+}
+
+/* ========================================================
+ * Fast bins
+ * With a fast bin limit set, a freed block of at most
+ * FAST_MAX bytes is not coalesced but pushed, still marked
+ * in use, onto a singly linked list of blocks of exactly its
+ * size, and a request of that size pops it again.  Churn at
+ * one size then never touches the bins or the neighbours'
+ * tags.  The fast bins are consolidated, each block going
+ * through insert_free_block(), in one pass when they hold
+ * more than the limit, when the bins cannot serve a request
+ * and before a purge.
+ *
+ * The limit may be set at build time with
+ * -DFAST_BIN_LIMIT=<bytes> or at run time through the
+ * TS_FAST_BINS environment variable; 0, the default, frees
+ * every block straight into the bins.
+ * ======================================================== */
+#ifndef FAST_BIN_LIMIT
+#define FAST_BIN_LIMIT 0
+#endif
+
+static size_t fast_bin_limit = FAST_BIN_LIMIT;
+
+__attribute__((constructor)) static void read_fast_config(void) {
+  const char *env = getenv("TS_FAST_BINS");
+  if (env != NULL && *env != '\0') {
+    fast_bin_limit = strtoul(env, NULL, 0);
+  }
+}
+
+/* Merge every fast block into the bins */
+static void fast_consolidate(heap_t *heap) {
+  for (size_t idx = 0; idx < NUM_FAST && heap->fast_bytes != 0; idx++) {
+    block_t *block = heap->fast[idx];
+    heap->fast[idx] = NULL;
+    while (block != NULL) {
+      block_t *next = block->next;
+      heap->fast_bytes -= block_size(block);
+      block->prev = NULL;   /* no key left behind if it merges */
+      insert_free_block(heap, block);
+      block = next;
+    }
+  }
+}
+
+/* Free a block into the fast bins; 0 if it has to go to the bins */
+static int fast_push(heap_t *heap, block_t *block) {
+  size_t size = block_size(block);
+  if (size > FAST_MAX || fast_bin_limit == 0) {
+    return 0;
+  }
+  if (harden_on()) {
+    block->prev = (block_t *)harden_key;
+  }
+  block->next = heap->fast[size / ALIGNMENT];
+  heap->fast[size / ALIGNMENT] = block;
+  heap->fast_bytes += size;
+  if (heap->fast_bytes > fast_bin_limit) {
+    fast_consolidate(heap);
+  }
+  return 1;
+}
+
+/* A fast block of exactly the given total size, if there is one */
+static block_t *fast_pop(heap_t *heap, size_t size) {
+  if (size > FAST_MAX) {
+    return NULL;
+  }
+  block_t *block = heap->fast[size / ALIGNMENT];
+  if (block != NULL) {
+    if (harden_on()) {
+      check_header(block);
+      if ((size_t)block->prev != harden_key || block_size(block) != size) {
+        harden_fail("corrupted fast bin", block_data(block));
+      }
+      block->prev = NULL;
+    }
+    heap->fast[size / ALIGNMENT] = block->next;
+    heap->fast_bytes -= size;
+  }
+  return block;
+}
+
+/* ========================================================
+ * Arena layer
+ * Address space is reserved from mmap RESERVE_SIZE at a time
+ * and handed out in chunks by bumping a pointer, so hitting
+ * the kernel is rare and the program break is never touched.
+ * Untouched pages of a reservation cost nothing until they
+ * are used.
+ *
+ * Every chunk is CHUNK_SIZE aligned and starts with a
+ * chunk_t, so the chunk of any pointer we hand out — and
+ * with it the kind of memory and its owner heap — is found
+ * by masking the pointer, without reading anything next to
+ * the user's data.  Only a large allocation aligned to
+ * CHUNK_SIZE or more starts right at a chunk boundary, with
+ * its header in the chunk before; CHUNK_OF() masks the byte
+ * before the pointer, which finds that header too.
+ * ======================================================== */
+#define PAGE_SIZE    4096UL
+#define CHUNK_SIZE   (2UL << 20)   /* heap refill size and alignment */
+#define RESERVE_SIZE (64UL << 20)  /* address space per mmap call    */
+
+#define PAGE_ALIGN(n) (((n) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define CHUNK_OF(p)   ((chunk_t *)(((uintptr_t)(p) - 1) & ~(CHUNK_SIZE - 1)))
+
+enum chunk_kind {
+  CHUNK_META,    /* allocator metadata, see base_alloc  */
+  CHUNK_BLOCKS,  /* boundary-tagged blocks, see above   */
+  CHUNK_SLABS,   /* slab pages of small objects         */
+  CHUNK_HUGE,    /* one large allocation, see map_large */
+  CHUNK_LOCKFREE /* objects of one lock-free class      */
+};
+
+typedef struct chunk {
+  enum chunk_kind kind;
+  heap_t *heap;        /* owner heap of blocks and slabs */
+  size_t size;         /* bytes mapped for a huge chunk  */
+} chunk_t;
+
+/* Where a block chunk's blocks start, and the size of one spanning it */
+#define CHUNK_FIRST_BLOCK \
+  (ALIGN_UP(sizeof(chunk_t) + HEADER_SIZE) - HEADER_SIZE)
+#define CHUNK_FREE_BLOCK (CHUNK_SIZE - CHUNK_FIRST_BLOCK - HEADER_SIZE)
+
+static ts_lock_t arena_mutex = LOCK_INITIALIZER(LOCK_CHUNK);
+static char *arena_cur = NULL;    /* next unused chunk of the reservation */
+static char *arena_end = NULL;    /* end of the current reservation       */
+static char *base_cur = NULL;     /* bump pointer for allocator metadata  */
+static char *base_end = NULL;
+
+/* Purged chunks are listed outside themselves: writing a link into
+ * one would fault a page (a whole huge page with THP) straight back */
+typedef struct spare {
+  chunk_t *chunk;
+  struct spare *next;
+} spare_t;
+
+static spare_t *arena_spare = NULL;  /* purged chunks, ready for reuse */
+static spare_t *spare_nodes = NULL;  /* unused spare_t records        */
+
+/* ========================================================
+ * Huge pages
+ * CHUNK_SIZE is the x86-64 huge page size and every chunk is
+ * aligned to it, so chunks can be backed by 2 MiB pages: in
+ * "thp" mode each reservation is madvised MADV_HUGEPAGE for
+ * transparent huge pages; in "hugetlb" mode reservations are
+ * mapped with MAP_HUGETLB from the preallocated pool (without
+ * MAP_NORESERVE, so an empty pool fails the mmap instead of
+ * faulting later) and fall back to "thp" once the pool runs
+ * dry.  Large allocations keep ordinary pages.  The mode is
+ * set at build time with -DHUGEPAGE_MODE=<0|1|2> or at run
+ * time with TS_HUGEPAGES=off|thp|hugetlb.
+ * ======================================================== */
+#define HUGEPAGE_OFF     0
+#define HUGEPAGE_THP     1
+#define HUGEPAGE_HUGETLB 2
+
+#ifndef HUGEPAGE_MODE
+#define HUGEPAGE_MODE HUGEPAGE_OFF
+#endif
+
+static int hugepage_mode = HUGEPAGE_MODE;
+
+__attribute__((constructor)) static void read_hugepage_config(void) {
+  const char *env = getenv("TS_HUGEPAGES");
+  if (env == NULL || *env == '\0') {
+    return;
+  }
+  if (strcmp(env, "thp") == 0) {
+    hugepage_mode = HUGEPAGE_THP;
+  } else if (strcmp(env, "hugetlb") == 0) {
+    hugepage_mode = HUGEPAGE_HUGETLB;
+  } else {
+    hugepage_mode = HUGEPAGE_OFF;
+  }
+}
+
+/* Map size bytes (page aligned) at an address a such that a + CHUNK_SIZE
+ * is align aligned, align being CHUNK_SIZE or a larger power of two;
+ * a itself is then CHUNK_SIZE aligned */
+static void *map_chunk(size_t size, size_t align, int flags) {
+  if (size > SIZE_MAX - align) {
+    return NULL;
+  }
+  char *mem = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+
+  /* Trim the misaligned head and the unused tail */
+  char *aligned = (char *)((((uintptr_t)mem + CHUNK_SIZE + align - 1) &
+                            ~(align - 1)) - CHUNK_SIZE);
+  if (aligned > mem) {
+    munmap(mem, aligned - mem);
+  }
+  if (aligned + size < mem + size + align) {
+    munmap(aligned + size, mem + align - aligned);
+  }
+  stat_os(1, (aligned > mem) + (aligned + size < mem + size + align), size);
+  return aligned;
+}
+
+/* Take a spare or a fresh chunk; arena_mutex must be held */
+static chunk_t *arena_take(void) {
+  if (arena_spare != NULL) {
+    spare_t *spare = arena_spare;
+    arena_spare = spare->next;
+    spare->next = spare_nodes;
+    spare_nodes = spare;
+    return spare->chunk;
+  }
+  if (arena_cur == arena_end) {
+    arena_cur = NULL;
+    if (hugepage_mode == HUGEPAGE_HUGETLB) {
+      arena_cur = map_chunk(RESERVE_SIZE, CHUNK_SIZE, MAP_HUGETLB);
+      if (arena_cur == NULL) {
+        hugepage_mode = HUGEPAGE_THP;
+      }
+    }
+    if (arena_cur == NULL) {
+      arena_cur = map_chunk(RESERVE_SIZE, CHUNK_SIZE, MAP_NORESERVE);
+      if (arena_cur != NULL && hugepage_mode == HUGEPAGE_THP) {
+        madvise(arena_cur, RESERVE_SIZE, MADV_HUGEPAGE);
+      }
+    }
+    arena_end = arena_cur != NULL ? arena_cur + RESERVE_SIZE : NULL;
+  }
+  chunk_t *chunk = (chunk_t *)arena_cur;
+  if (chunk != NULL) {
+    arena_cur += CHUNK_SIZE;
+  }
+  return chunk;
+}
+
+/* ========================================================
+ * NUMA placement
+ * A heap with a numa_mask has the pages of every chunk it
+ * maps bound to those nodes (preferred, so a full node
+ * falls back to the others) before anything touches them;
+ * any other memory lands wherever the thread that first
+ * touches it runs.  The node count comes from sysfs, read
+ * without allocating since it may happen inside malloc, and
+ * TS_NUMA=0 turns placement off.
+ * ======================================================== */
+#define MAX_NUMA_NODES 64
+#define TS_MPOL_PREFERRED 1   /* MPOL_PREFERRED from <linux/mempolicy.h> */
+
+static unsigned numa_nodes = 1;
+
+/* One more than the highest node listed in sysfs, e.g. "0-1" or "0,2" */
+static void numa_init(void) {
+  const char *env = getenv("TS_NUMA");
+  if (env != NULL && strcmp(env, "0") == 0) {
+    return;
+  }
+
+  char buf[256];
+  int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return;
+  }
+  buf[len] = '\0';
+
+  unsigned highest = 0, value = 0;
+  for (char *c = buf; *c != '\0'; c++) {
+    if (*c >= '0' && *c <= '9') {
+      value = value * 10 + (*c - '0');
+      highest = value > highest ? value : highest;
+    } else {
+      value = 0;
+    }
+  }
+  numa_nodes = highest < MAX_NUMA_NODES ? highest + 1 : MAX_NUMA_NODES;
+}
+
+static unsigned current_node(void) {
+  unsigned cpu, node;
+  if (numa_nodes == 1 || getcpu(&cpu, &node) != 0 || node >= numa_nodes) {
+    return 0;
+  }
+  return node;
+}
+
+static void bind_chunk(chunk_t *chunk, unsigned long mask) {
+  syscall(SYS_mbind, chunk, CHUNK_SIZE, TS_MPOL_PREFERRED, &mask,
+          MAX_NUMA_NODES + 1, 0);
+}
+
+/* Map one zeroed chunk of the given kind for the given owner */
+static chunk_t *arena_alloc(enum chunk_kind kind, heap_t *heap) {
+  lock_acquire(&arena_mutex);
+  if (hardened < 0) {
+    harden_configure();
+  }
+  chunk_t *chunk = arena_take();
+  lock_release(&arena_mutex);
+
+  if (chunk != NULL && heap != NULL && heap->numa_mask != 0) {
+    bind_chunk(chunk, heap->numa_mask);
+  }
+  if (chunk != NULL) {
+    chunk->kind = kind;
+    chunk->heap = heap;
+    chunk->size = CHUNK_SIZE;
+  }
+  return chunk;
+}
+
+/* Permanent, zeroed storage for allocator metadata such as heaps,
+ * in whole cache lines so no two threads' metadata share one;
+ * arena_mutex must be held */
+static void *base_carve(size_t size) {
+  void *mem = NULL;
+  size = (size + CACHE_LINE - 1) & ~(CACHE_LINE - 1UL);
+
+  if ((size_t)(base_end - base_cur) < size) {
+    chunk_t *chunk = arena_take();
+    if (chunk != NULL) {
+      chunk->kind = CHUNK_META;
+      base_cur = (char *)(((uintptr_t)(chunk + 1) + CACHE_LINE - 1) &
+                          ~(CACHE_LINE - 1UL));
+      base_end = (char *)chunk + CHUNK_SIZE;
+    }
+  }
+  if ((size_t)(base_end - base_cur) >= size) {
+    mem = base_cur;
+    base_cur += size;
+  }
+  return mem;
+}
+
+static void *base_alloc(size_t size) {
+  lock_acquire(&arena_mutex);
+  void *mem = base_carve(size);
+  lock_release(&arena_mutex);
+  return mem;
+}
+
+/* Drop the pages of a chunk no heap uses any more and keep it for
+ * reuse; without a record for it the chunk is only dropped.  Returns 0,
+ * with the chunk untouched, if its pages could not be dropped: spare
+ * chunks are handed out as zeroed */
+static int arena_release(chunk_t *chunk) {
+  if (madvise(chunk, CHUNK_SIZE, MADV_DONTNEED) != 0) {
+    return 0;
+  }
+
+  lock_acquire(&arena_mutex);
+  spare_t *spare = spare_nodes;
+  if (spare != NULL) {
+    spare_nodes = spare->next;
+  } else {
+    spare = base_carve(sizeof(spare_t));
+  }
+  if (spare != NULL) {
+    spare->chunk = chunk;
+    spare->next = arena_spare;
+    arena_spare = spare;
+  }
+  lock_release(&arena_mutex);
+  return 1;
+}
+
+/* ========================================================
+ * Helper: grow a heap by one chunk from the arena layer and
+ * satisfy the request from it.  The chunk becomes a single
+ * free block whose own BLOCK_PREV_ALLOC flag is set and which
+ * ends at an allocated end tag, so coalescing never leaves
+ * the chunk.
+ * The caller must be allowed to modify the heap.
+ * ======================================================== */
+static int heap_grow(heap_t *heap) {
+  chunk_t *chunk = arena_alloc(CHUNK_BLOCKS, heap);
+  if (chunk == NULL) {
+    return 0;
+  }
+
+  block_t *block = (block_t *)((char *)chunk + CHUNK_FIRST_BLOCK);
+  block_t *end_tag = (block_t *)((char *)chunk + CHUNK_SIZE - HEADER_SIZE);
+  set_header(end_tag, BLOCK_ALLOC);
+  set_header(block, 0);
+  set_free(block, CHUNK_FREE_BLOCK);
+  set_header(block, block_header(block) | BLOCK_ZERO);
+  bin_push(heap, block);
+  return 1;
+}
+
+static block_t *extend_heap(heap_t *heap, size_t size) {
+  return heap_grow(heap) ? best_fit_search(heap, size) : NULL;
+}
+
+/* ========================================================
+ * Slabs
+ * Requests of up to SLAB_MAX bytes are rounded to a multiple
+ * of SLAB_QUANTUM and served from SLAB_SIZE pages that hold
+ * objects of a single size.  Objects carry no header: the
+ * chunk header found by masking the address has a slab_t
+ * per page, which keeps the page's free list.  Each heap
+ * keeps, per class, a list of its slabs that still have
+ * room; allocation and free are O(1).
+ * ======================================================== */
+#define SLAB_SIZE       (64UL << 10)
+#define SLABS_PER_CHUNK (CHUNK_SIZE / SLAB_SIZE)
+
+typedef struct slab {
+  struct slab *next;   /* next slab of the class with room         */
+  void *free;          /* freed objects, linked through first word */
+  char *bump;          /* first object never handed out            */
+  char *end;           /* end of the last whole object             */
+  unsigned size;       /* object size                              */
+  unsigned used;       /* objects currently handed out             */
+  int listed;          /* on the heap's list for its class         */
+} slab_t;
+
+typedef struct slab_chunk {
+  chunk_t hdr;
+  unsigned next_slab;              /* first page not yet a slab */
+  slab_t slabs[SLABS_PER_CHUNK];   /* one per SLAB_SIZE page    */
+} slab_chunk_t;
+
+/* First object of a slab; the first page also holds the chunk header */
+static char *slab_start(slab_chunk_t *chunk, size_t idx) {
+  char *start = idx == 0 ? (char *)(chunk + 1)
+                         : (char *)chunk + idx * SLAB_SIZE;
+  return (char *)(((uintptr_t)start + SLAB_QUANTUM - 1) &
+                  ~(SLAB_QUANTUM - 1));
+}
+
+static slab_t *slab_new(heap_t *heap, size_t cls) {
+  slab_chunk_t *chunk = heap->slab_chunk;
+  if (chunk == NULL || chunk->next_slab == SLABS_PER_CHUNK) {
+    chunk = (slab_chunk_t *)arena_alloc(CHUNK_SLABS, heap);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    heap->slab_chunk = chunk;
+  }
+
+  size_t idx = chunk->next_slab++;
+  char *page = (char *)chunk + idx * SLAB_SIZE;
+  char *start = slab_start(chunk, idx);
+
+  slab_t *slab = &chunk->slabs[idx];
+  slab->size = (cls + 1) * SLAB_QUANTUM;
+  slab->free = NULL;
+  slab->bump = start;
+  slab->end = start + (page + SLAB_SIZE - start) / slab->size * slab->size;
+  slab->used = 0;
+  slab->listed = 1;
+  slab->next = heap->slabs[cls];
+  heap->slabs[cls] = slab;
+  return slab;
+}
+
+static void *slab_alloc(heap_t *heap, size_t size) {
+  size_t cls = (size - 1) / SLAB_QUANTUM;
+  slab_t *slab = heap->slabs[cls];
+  if (slab == NULL && (slab = slab_new(heap, cls)) == NULL) {
+    return NULL;
+  }
+
+  void *obj = slab->free;
+  if (obj != NULL) {
+    slab->free = *(void **)obj;
+    unmark_freed(obj);
+  } else {
+    obj = slab->bump;
+    slab->bump += slab->size;
+  }
+  slab->used++;
+
+  /* A full slab leaves the list until something is freed into it */
+  if (slab->free == NULL && slab->bump == slab->end) {
+    heap->slabs[cls] = slab->next;
+    slab->listed = 0;
+  }
+  return obj;
+}
+
+static inline slab_t *slab_of(chunk_t *chunk, void *ptr) {
+  size_t idx = ((char *)ptr - (char *)chunk) / SLAB_SIZE;
+  return &((slab_chunk_t *)chunk)->slabs[idx];
+}
+
+static void slab_free(heap_t *heap, chunk_t *chunk, void *ptr) {
+  slab_t *slab = slab_of(chunk, ptr);
+
+  *(void **)ptr = slab->free;
+  mark_freed(ptr);
+  slab->free = ptr;
+  slab->used--;
+
+  if (!slab->listed) {
+    size_t cls = slab->size / SLAB_QUANTUM - 1;
+    slab->next = heap->slabs[cls];
+    heap->slabs[cls] = slab;
+    slab->listed = 1;
+  }
+}
+
+/* ========================================================
+ * Purging
+ * Free memory is handed back to the kernel once a heap has
+ * had trim_threshold bytes freed into it since the last
+ * purge, and on ts_malloc_trim().  A chunk that has become
+ * one free block leaves the heap and is kept, without its
+ * pages, for the next chunk anyone maps; any other free
+ * block of at least PURGE_MIN bytes keeps its tags and bin
+ * links but loses the whole pages in between, as does every
+ * empty slab.  Purged pages come back zero-filled when they
+ * are next touched.  In a huge page mode only whole chunks
+ * are purged.
+ *
+ * The default may be overridden at build time with
+ * -DTRIM_THRESHOLD=<bytes> or at run time through the
+ * TS_TRIM_THRESHOLD environment variable; 0 leaves purging
+ * to ts_malloc_trim() alone.
+ * ======================================================== */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (8UL << 20)
+#endif
+#define PURGE_MIN (16 * PAGE_SIZE)
+
+static size_t trim_threshold = TRIM_THRESHOLD;
+
+__attribute__((constructor)) static void read_trim_config(void) {
+  const char *env = getenv("TS_TRIM_THRESHOLD");
+  if (env != NULL && *env != '\0') {
+    trim_threshold = strtoul(env, NULL, 0);
+  }
+}
+
+/* Let the kernel reclaim the whole pages in [start, end); with huge
+ * pages only whole chunks go, so no huge page is ever split */
+static size_t purge_pages(char *start, char *end) {
+  size_t page = hugepage_mode != HUGEPAGE_OFF ? CHUNK_SIZE : PAGE_SIZE;
+  char *lo = (char *)(((uintptr_t)start + page - 1) & ~(page - 1));
+  char *hi = (char *)((uintptr_t)end & ~(page - 1));
+  if (hi <= lo) {
+    return 0;
+  }
+  madvise(lo, hi - lo, MADV_DONTNEED);
+  return hi - lo;
+}
+
+/* The same for a range that must read as zero afterwards, so what is
+ * left of the pages at either end is cleared by hand; nothing is if
+ * no whole page could go */
+static size_t purge_zero(char *start, char *end) {
+  size_t released = purge_pages(start, end);
+  if (released != 0) {
+    size_t page = hugepage_mode != HUGEPAGE_OFF ? CHUNK_SIZE : PAGE_SIZE;
+    char *lo = (char *)(((uintptr_t)start + page - 1) & ~(page - 1));
+    memset(start, 0, lo - start);
+    memset(lo + released, 0, end - (lo + released));
+  }
+  return released;
+}
+
+static size_t free_list_walk(heap_t *heap, block_t **out, size_t *problems);
+
+/* Returns the number of bytes given back; the caller must own the heap */
+static size_t heap_purge(heap_t *heap) {
+  size_t released = 0;
+  heap->freed = 0;
+  if (harden_on()) {
+    size_t problems = 0;
+    free_list_walk(heap, NULL, &problems);
+    if (problems != 0) {
+      abort();
+    }
+  }
+  fast_consolidate(heap);
+
+  for (size_t idx = bin_index(PURGE_MIN); idx < NUM_BINS; idx++) {
+    block_t *block = heap->bins[idx];
+    while (block != NULL) {
+      block_t *next = block->next;
+      if (block_size(block) == CHUNK_FREE_BLOCK) {
+        /* Released, the block's links are gone; kept, it goes back */
+        bin_remove(heap, block);
+        if (arena_release(CHUNK_OF(block))) {
+          released += CHUNK_SIZE;
+        } else {
+          bin_push(heap, block);
+        }
+      } else if (block_size(block) >= PURGE_MIN) {
+        released += purge_pages((char *)(block + 1),
+                                (char *)block + block_size(block) - TAG_SIZE);
+      }
+      block = next;
+    }
+  }
+
+  /* An empty slab whose pages could go starts over, zeroed, from its
+   * first object */
+  for (size_t cls = 0; cls < SLAB_CLASSES; cls++) {
+    for (slab_t *slab = heap->slabs[cls]; slab != NULL; slab = slab->next) {
+      slab_chunk_t *chunk = (slab_chunk_t *)CHUNK_OF(slab);
+      size_t idx = slab - chunk->slabs;
+      char *start = slab_start(chunk, idx);
+      size_t purged;
+      if (slab->used == 0 && slab->bump != start &&
+          (purged = purge_zero(start, slab->bump)) != 0) {
+        released += purged;
+        slab->free = NULL;
+        slab->bump = start;
+      }
+    }
+  }
+  return released;
+}
+
+/* Account for memory freed into a heap and purge when due */
+static inline void heap_freed(heap_t *heap, size_t size) {
+  heap->freed += size;
+  if (trim_threshold != 0 && heap->freed >= trim_threshold) {
+    heap_purge(heap);
+  }
+}
+
+/* ========================================================
+ * Helpers shared by the versions that own a whole heap:
+ * allocate from it, or give memory back to it.  The caller
+ * must be allowed to modify the heap.
+ * ======================================================== */
+
+/* A block of the given total size; *zero is set if it had BLOCK_ZERO */
+static block_t *heap_take(heap_t *heap, size_t size, int *zero) {
+  /* A block of this very size freed recently */
+  block_t *block = fast_pop(heap, size);
+  if (block != NULL) {
+    *zero = 0;
+    return block;
+  }
+
+  /* Otherwise the free bins, and if they fail, the bins with the
+   * fast blocks merged in */
+  block = bin_take(heap, size);
+  if (block == NULL && heap->fast_bytes != 0) {
+    fast_consolidate(heap);
+    block = bin_take(heap, size);
+  }
+
+  /* No suitable free block — grow the heap by a chunk */
+  if (block == NULL && heap_grow(heap)) {
+    block = bin_take(heap, size);
+  }
+
+  if (block != NULL) {
+    *zero = split_block(heap, block, size);
+  }
+  return block;
+}
+
+static void *heap_alloc(heap_t *heap, size_t size) {
+  if (size <= SLAB_MAX) {
+    return slab_alloc(heap, size);
+  }
+  int zero;
+  block_t *block = heap_take(heap, request_size(size), &zero);
+  return block != NULL ? block_data(block) : NULL;
+}
+
+/* Zero the first bytes of a block just taken: all of them, or with
+ * BLOCK_ZERO only what the free block's links and tag overwrote */
+static void *block_clear(block_t *block, int zero, size_t bytes) {
+  void *ptr = block_data(block);
+  if (!zero) {
+    memset(ptr, 0, bytes);
+  } else {
+    memset(ptr, 0, sizeof(block_t) - HEADER_SIZE);
+    *(size_t *)((char *)block + block_size(block) - TAG_SIZE) = 0;
+  }
+  return ptr;
+}
+
+/* Objects never handed out before come zero-filled from the chunk */
+static void *heap_calloc(heap_t *heap, size_t size) {
+  if (size <= SLAB_MAX) {
+    slab_t *slab = heap->slabs[(size - 1) / SLAB_QUANTUM];
+    int reused = slab != NULL && slab->free != NULL;
+    void *ptr = slab_alloc(heap, size);
+    if (ptr != NULL && reused) {
+      memset(ptr, 0, size);
+    }
+    return ptr;
+  }
+  int zero;
+  block_t *block = heap_take(heap, request_size(size), &zero);
+  return block != NULL ? block_clear(block, zero, size) : NULL;
+}
+
+static void heap_free(heap_t *heap, chunk_t *chunk, void *ptr) {
+  size_t size;
+  if (chunk->kind == CHUNK_SLABS) {
+    size = slab_of(chunk, ptr)->size;
+    slab_free(heap, chunk, ptr);
+  } else {
+    size = block_size(data_block(ptr));
+    if (!fast_push(heap, data_block(ptr))) {
+      insert_free_block(heap, data_block(ptr));
+    }
+  }
+  heap_freed(heap, size);
+}
+
+/* Slab objects can only stay put if they already fit */
+static int heap_resize(heap_t *heap, chunk_t *chunk, void *ptr, size_t size) {
+  if (chunk->kind == CHUNK_SLABS) {
+    return size <= slab_of(chunk, ptr)->size;
+  }
+  return resize_block(heap, data_block(ptr), request_size(size));
+}
+
+/* ========================================================
+ * Helper: aligned allocation from a heap's blocks, for a
+ * power-of-two alignment above ALIGNMENT.  The bins are
+ * searched for a free block with an aligned stretch of the
+ * requested size inside it: from the request's own bin up
+ * to that of size + alignment + MIN_BLOCK each block is
+ * checked, and in any higher bin every block fits, so the
+ * first is taken.  The fast bins are consolidated, and a
+ * chunk added, only if no block fits.  The leading slack,
+ * which is either empty or big enough to be a block of its
+ * own, is given back to the heap along with any trailing
+ * remainder.
+ * ======================================================== */
+
+/* Bytes before the first aligned user pointer a block can hold */
+static size_t aligned_lead(block_t *block, size_t alignment) {
+  uintptr_t data = (uintptr_t)block_data(block);
+  uintptr_t aligned = (data + alignment - 1) & ~(alignment - 1);
+  if (aligned != data && aligned - data < MIN_BLOCK) {
+    aligned += alignment;
+  }
+  return aligned - data;
+}
+
+/* The first block that fits, taken out of its bin but not split */
+static block_t *bin_take_aligned(heap_t *heap, size_t alignment,
+                                 size_t size) {
+  size_t sure = bin_index(size + alignment + MIN_BLOCK);
+  unsigned long bins = heap->binmap & ~((1UL << bin_index(size)) - 1);
+
+  for (; bins != 0; bins &= bins - 1) {
+    size_t idx = __builtin_ctzl(bins);
+    for (block_t *curr = heap->bins[idx]; curr != NULL; curr = curr->next) {
+      if (idx > sure ||
+          aligned_lead(curr, alignment) + size <= block_size(curr)) {
+        bin_remove(heap, curr);
+        return curr;
+      }
+    }
+  }
+  return NULL;
+}
+
+static block_t *block_memalign(heap_t *heap, size_t alignment, size_t size) {
+  size = request_size(size);
+
+  block_t *block = bin_take_aligned(heap, alignment, size);
+  if (block == NULL && heap->fast_bytes != 0) {
+    fast_consolidate(heap);
+    block = bin_take_aligned(heap, alignment, size);
+  }
+  if (block == NULL && heap_grow(heap)) {
+    block = bin_take_aligned(heap, alignment, size);
+  }
+  if (block == NULL) {
+    return NULL;
+  }
+
+  size_t lead = aligned_lead(block, alignment);
+  if (lead != 0) {
+    size_t total = block_size(block);
+    block_t *body = (block_t *)((char *)block + lead);
+    set_header(block, lead | BLOCK_ALLOC |
+                      (block_header(block) & BLOCK_PREV_ALLOC));
+    set_header(body, (total - lead) | BLOCK_ALLOC | BLOCK_PREV_ALLOC);
+    insert_free_block(heap, block);
+    block = body;
+  }
+
+  split_block(heap, block, size);
+  return block;
+}
+
+/* Only for alignments past ALIGNMENT, which slabs do not give */
+static void *heap_memalign(heap_t *heap, size_t alignment, size_t size) {
+  block_t *block = block_memalign(heap, alignment, size);
+  return block != NULL ? block_data(block) : NULL;
+}
+
+/* Rejects what no version can align; the caller handles the rest */
+static int bad_alignment(size_t alignment, size_t size) {
+  return size == 0 || size > MAX_REQUEST || alignment > MAX_REQUEST ||
+         (alignment & (alignment - 1)) != 0;
+}
+
+/* A sized free trusts the caller's size; with -DMALLOC_DEBUG or in
+ * hardened mode it is checked against the block, and a size the block
+ * cannot hold aborts */
+static inline void check_free_size(void *ptr, size_t size) {
+#ifndef MALLOC_DEBUG
+  if (!harden_on()) {
+    return;
+  }
+#endif
+  size_t usable = usable_size(ptr);
+  if (size > usable) {
+    fprintf(stderr, "ts_free_sized: %p holds %zu bytes, not %zu\n", ptr,
+            usable, size);
+    abort();
+  }
+}
+
+/* Hardened mode: abort unless ptr is live memory from a heap owns()
+ * accepts or, if owns is NULL, from the lock-free pools */
+static void check_free(void *ptr, int (*owns)(heap_t *heap));
+
+static inline void harden_free(void *ptr, int (*owns)(heap_t *heap)) {
+  if (harden_on()) {
+    check_free(ptr, owns);
+  }
+}
+
+/* Bytes calloc has to clear; 0 if there are none or too many */
+static size_t calloc_bytes(size_t nmemb, size_t size) {
+  size_t bytes;
+  if (__builtin_mul_overflow(nmemb, size, &bytes) || bytes > MAX_REQUEST) {
+    return 0;
+  }
+  return bytes;
+}
+
+/* ========================================================
+ * Large allocations
+ * Requests of at least mmap_threshold bytes get a chunk of
+ * their own straight from mmap and are unmapped again on
+ * free.  They never enter a heap, so they cannot fragment it
+ * or lengthen its bins, and their pages go back to the
+ * kernel at once.  The default may be overridden at build
+ * time with -DMMAP_THRESHOLD=<bytes> or at run time through
+ * the TS_MMAP_THRESHOLD environment variable; anything
+ * below it must fit in one heap chunk.
+ * ======================================================== */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (256UL << 10)
+#endif
+#define MAX_MMAP_THRESHOLD (CHUNK_SIZE / 2)
+#define HUGE_OFFSET        64  /* user data offset within a huge chunk */
+
+_Static_assert(MMAP_THRESHOLD <= MAX_MMAP_THRESHOLD,
+               "MMAP_THRESHOLD must leave requests below it a heap chunk");
+
+static size_t mmap_threshold = MMAP_THRESHOLD;
+
+__attribute__((constructor)) static void read_config(void) {
+  const char *env = getenv("TS_MMAP_THRESHOLD");
+  if (env != NULL && *env != '\0') {
+    mmap_threshold = strtoul(env, NULL, 0);
+    if (mmap_threshold > MAX_MMAP_THRESHOLD) {
+      mmap_threshold = MAX_MMAP_THRESHOLD;
+    }
+  }
+}
+
+/* The data sits at HUGE_OFFSET, or at the alignment if that is larger.
+ * An alignment of CHUNK_SIZE or more puts it at the start of the
+ * mapping's second chunk, where CHUNK_OF() still finds the first */
+static void *map_large(size_t alignment, size_t size) {
+  size_t offset = alignment > HUGE_OFFSET ? alignment : HUGE_OFFSET;
+  size_t align = CHUNK_SIZE;
+  if (offset >= CHUNK_SIZE) {
+    align = offset;
+    offset = CHUNK_SIZE;
+  }
+
+  size_t length = PAGE_ALIGN(offset + size);
+  chunk_t *chunk = map_chunk(length, align, MAP_NORESERVE);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  chunk->kind = CHUNK_HUGE;
+  chunk->heap = NULL;
+  chunk->size = length;
+  return (char *)chunk + offset;
+}
+
+static void unmap_large(chunk_t *chunk) {
+  stat_os(0, 1, -chunk->size);
+  munmap(chunk, chunk->size);
+}
+
+/* Shrink by unmapping the tail, grow only where mremap need not move */
+static int resize_large(chunk_t *chunk, void *ptr, size_t size) {
+  if (size < mmap_threshold) {
+    return 0;
+  }
+
+  size_t length = PAGE_ALIGN((char *)ptr - (char *)chunk + size);
+  if (length < chunk->size) {
+    munmap((char *)chunk + length, chunk->size - length);
+    stat_os(0, 1, length - chunk->size);
+  } else if (length > chunk->size) {
+    void *mem = mremap(chunk, chunk->size, length, 0);
+    stat_os(1, 0, mem != MAP_FAILED ? length - chunk->size : 0);
+    if (mem == MAP_FAILED) {
+      return 0;
+    }
+  }
+  chunk->size = length;
+  return 1;
+}
+
+/* Last resort for every version: move the data to a new allocation */
+static void *move_allocation(void *ptr, size_t size,
+                             void *(*alloc)(size_t), void (*release)(void *)) {
+  void *new_ptr = alloc(size);
+  if (new_ptr != NULL) {
+    size_t old_size = ts_malloc_usable_size(ptr);
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    release(ptr);
+  }
+  return new_ptr;
+}
+
+/* Batch allocations of mmap_threshold bytes or more: one mapping each */
+static size_t map_large_batch(size_t size, void **ptrs, size_t n) {
+  size_t i = 0;
+  while (i < n && (ptrs[i] = map_large(0, size)) != NULL) {
+    i++;
+  }
+  return i;
+}
+
+/* Sort pointers by address, so a batch free meets each chunk's memory
+ * in one run.  A shell sort in place, since it may run inside free. */
+static void sort_ptrs(void **ptrs, size_t n) {
+  size_t gap = 1;
+  while (gap < n / 3) {
+    gap = 3 * gap + 1;
+  }
+  for (; gap > 0; gap /= 3) {
+    for (size_t i = gap; i < n; i++) {
+      void *ptr = ptrs[i];
+      size_t j = i;
+      for (; j >= gap && (uintptr_t)ptrs[j - gap] > (uintptr_t)ptr; j -= gap) {
+        ptrs[j] = ptrs[j - gap];
+      }
+      ptrs[j] = ptr;
+    }
+  }
+}
+
+/* ================================================================
+ * VERSION 1 — Lock-based thread-safe malloc / free
+ *
+ * Strategy: the heap is striped into lock_arena_count independent
+ * arenas, each a heap with its own mutex.  A thread starts at the
+ * arena it last used (handed out round-robin on its first call)
+ * and, if that one is busy, moves on to the first arena whose
+ * lock it can take without waiting; only when every arena is busy
+ * does it block.  Free locks the arena that owns the memory,
+ * found from its chunk.  Every heap operation is still done under
+ * a mutex, but threads only contend when they share an arena.
+ *
+ * The number of arenas defaults to twice the number of online
+ * CPUs and may be set with the TS_LOCK_ARENAS environment
+ * variable, up to MAX_LOCK_ARENAS.
+ *
+ * On a NUMA machine arena i serves node i % numa_nodes and its
+ * chunks are bound there.  A thread picks a home arena on the node
+ * it is running on, moves when it finds itself on another node,
+ * and tries the rest of its node's arenas before anyone else's.
+ * Frees still go to the owning arena, and so to the owning node.
+ * ================================================================ */
+
+#define MAX_LOCK_ARENAS 64
+
+typedef struct lock_arena {
+  heap_t heap;            /* first, so a chunk's heap is its arena */
+  ts_lock_t lock;
+} __attribute__((aligned(CACHE_LINE))) lock_arena_t;
+
+static lock_arena_t lock_arenas[MAX_LOCK_ARENAS];
+static unsigned lock_arena_count = 1;
+static unsigned lock_arena_next = 0;        /* round-robin for new threads */
+static __thread int lock_arena_home = -1;   /* arena this thread last used */
+
+__attribute__((constructor)) static void init_lock_arenas(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  lock_arena_count = cpus > 0 ? 2 * cpus : 1;
+
+  const char *env = getenv("TS_LOCK_ARENAS");
+  if (env != NULL && *env != '\0') {
+    lock_arena_count = strtoul(env, NULL, 0);
+  }
+  if (lock_arena_count < 1) {
+    lock_arena_count = 1;
+  } else if (lock_arena_count > MAX_LOCK_ARENAS) {
+    lock_arena_count = MAX_LOCK_ARENAS;
+  }
+
+  /* Every node gets the same number of arenas */
+  numa_init();
+  if (numa_nodes > 1) {
+    lock_arena_count = (lock_arena_count + numa_nodes - 1) / numa_nodes *
+                       numa_nodes;
+    if (lock_arena_count > MAX_LOCK_ARENAS) {
+      lock_arena_count = MAX_LOCK_ARENAS / numa_nodes * numa_nodes;
+    }
+  }
+
+  for (unsigned i = 0; i < MAX_LOCK_ARENAS; i++) {
+    pthread_mutex_init(&lock_arenas[i].lock.mutex, NULL);
+    if (numa_nodes > 1) {
+      lock_arenas[i].heap.numa_mask = 1UL << (i % numa_nodes);
+    }
+  }
+}
+
+/* Lock and return an arena for a new allocation, on the local node */
+static lock_arena_t *lock_arena_acquire(void) {
+  unsigned count = lock_arena_count;
+  unsigned per_node = count / numa_nodes;
+  unsigned node = current_node();
+
+  if (lock_arena_home < 0 || (unsigned)lock_arena_home % numa_nodes != node) {
+    unsigned next = __atomic_fetch_add(&lock_arena_next, 1, __ATOMIC_RELAXED);
+    lock_arena_home = (next % per_node) * numa_nodes + node;
+  }
+
+  /* This node's arenas first, then those of the next node, ... */
+  for (unsigned i = 0; i < count; i++) {
+    unsigned idx = (lock_arena_home + i * numa_nodes + i / per_node) % count;
+    if (lock_try(&lock_arenas[idx].lock)) {
+      if (idx % numa_nodes == node) {
+        lock_arena_home = idx;
+      }
+      return &lock_arenas[idx];
+    }
+  }
+
+  lock_arena_t *arena = &lock_arenas[lock_arena_home];
+  lock_acquire(&arena->lock);
+  return arena;
+}
+
+/* Lock and return the arena owning a chunk */
+static lock_arena_t *lock_arena_of(chunk_t *chunk) {
+  lock_arena_t *arena = (lock_arena_t *)chunk->heap;
+  lock_acquire(&arena->lock);
+  return arena;
+}
+
+static int lock_owns(heap_t *heap) {
+  uintptr_t offset = (uintptr_t)heap - (uintptr_t)lock_arenas;
+  return offset < sizeof(lock_arenas) && offset % sizeof(lock_arena_t) == 0;
+}
+
+void *ts_malloc_lock(size_t size) {
+  if (size == 0 || size > MAX_REQUEST) {
+    return NULL;
+  }
+  if (size >= mmap_threshold) {
+    return stat_alloc(map_large(0, size));
+  }
+
+  lock_arena_t *arena = lock_arena_acquire();
+  void *ptr = heap_alloc(&arena->heap, size);
+  lock_release(&arena->lock);
+  return stat_alloc(ptr);
+}
+
+void ts_free_lock(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  harden_free(ptr, lock_owns);
+  stat_free(ptr);
+
+  chunk_t *chunk = CHUNK_OF(ptr);
+
+  /* Large blocks go straight back to the kernel */
+  if (chunk->kind == CHUNK_HUGE) {
+    unmap_large(chunk);
+    return;
+  }
+
+  lock_arena_t *arena = lock_arena_of(chunk);
+  heap_free(&arena->heap, chunk, ptr);
+  lock_release(&arena->lock);
+}
+
+/* Large mappings are fresh from the kernel, so never need clearing */
+void *ts_calloc_lock(size_t nmemb, size_t size) {
+  size_t bytes = calloc_bytes(nmemb, size);
+  if (bytes == 0) {
+    return NULL;
+  }
+  if (bytes >= mmap_threshold) {
+    return stat_alloc(map_large(0, bytes));
+  }
+
+  lock_arena_t *arena = lock_arena_acquire();
+  void *ptr = heap_calloc(&arena->heap, bytes);
+  lock_release(&arena->lock);
+  return stat_alloc(ptr);
+}
+
+void *ts_memalign_lock(size_t alignment, size_t size) {
+  if (alignment <= ALIGNMENT) {
+    return ts_malloc_lock(size);
+  }
+  if (bad_alignment(alignment, size)) {
+    return NULL;
+  }
+  if (size + alignment >= mmap_threshold) {
+    return stat_alloc(map_large(alignment, size));
+  }
+
+  lock_arena_t *arena = lock_arena_acquire();
+  void *ptr = heap_memalign(&arena->heap, alignment, size);
+  lock_release(&arena->lock);
+  return stat_alloc(ptr);
+}
+
+void *ts_realloc_lock(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return ts_malloc_lock(size);
+  }
+  if (size == 0) {
+    ts_free_lock(ptr);
+    return NULL;
+  }
+  if (size > MAX_REQUEST) {
+    return NULL;
+  }
+
+  chunk_t *chunk = CHUNK_OF(ptr);
+  size_t old_size = usable_size(ptr);
+  int in_place;
+  if (chunk->kind == CHUNK_HUGE) {
+    in_place = resize_large(chunk, ptr, size);
+  } else {
+    lock_arena_t *arena = lock_arena_of(chunk);
+    in_place = heap_resize(&arena->heap, chunk, ptr, size);
+    lock_release(&arena->lock);
+  }
+
+  if (in_place) {
+    stat_resize(ptr, old_size);
+    return ptr;
+  }
+  return move_allocation(ptr, size, ts_malloc_lock, ts_free_lock);
+}
+
+/* Fill ptrs with n blocks under one lock; returns how many were stored */
+size_t ts_malloc_batch_lock(size_t size, void **ptrs, size_t n) {
+  if (size == 0 || size > MAX_REQUEST) {
+    return 0;
+  }
+  if (size >= mmap_threshold) {
+    size_t i = map_large_batch(size, ptrs, n);
+    stat_alloc_batch(ptrs, i);
+    return i;
+  }
+
+  size_t i = 0;
+  lock_arena_t *arena = lock_arena_acquire();
+  while (i < n && (ptrs[i] = heap_alloc(&arena->heap, size)) != NULL) {
+    i++;
+  }
+  lock_release(&arena->lock);
+  stat_alloc_batch(ptrs, i);
+  return i;
+}
+
+/* Sorted, the memory of each arena comes in runs: one lock per run */
+void ts_free_batch_lock(void **ptrs, size_t n) {
+  stat_free_batch(ptrs, n);
+  sort_ptrs(ptrs, n);
+
+  lock_arena_t *held = NULL;
+  for (size_t i = 0; i < n; i++) {
+    if (ptrs[i] == NULL) {
+      continue;
+    }
+
+    harden_free(ptrs[i], lock_owns);
+    chunk_t *chunk = CHUNK_OF(ptrs[i]);
+    lock_arena_t *arena = chunk->kind == CHUNK_HUGE
+                              ? NULL : (lock_arena_t *)chunk->heap;
+    if (arena != held && held != NULL) {
+      lock_release(&held->lock);
+    }
+    if (arena == NULL) {
+      unmap_large(chunk);
+    } else {
+      if (arena != held) {
+        lock_acquire(&arena->lock);
+      }
+      heap_free(&arena->heap, chunk, ptrs[i]);
+    }
+    held = arena;
+  }
+  if (held != NULL) {
+    lock_release(&held->lock);
+  }
+}
+
+/* ================================================================
+ * VERSION 2 — Non-locking thread-safe malloc / free
+ *
+ * Strategy: each thread maintains its own heap via
+ * Thread-Local Storage (__thread).  No lock is needed when
+ * accessing the per-thread heap.
+ *
+ * The only lock is around the arena layer, taken once per chunk.
+ *
+ * Every chunk belongs to the heap that mapped it.  Memory freed
+ * by another thread is pushed onto its owner's remote-free stack
+ * with a single CAS; the owner drains the whole stack at once on
+ * its next malloc, so a stack only ever has one popper and needs
+ * no ABA protection.  The heap itself is permanent metadata,
+ * since remote frees may still arrive after its thread has
+ * exited.
+ *
+ * When a thread exits, its heap — with every chunk, free block
+ * and pending remote free it holds — goes to an orphan pool, and
+ * the next thread to need a heap adopts it whole instead of
+ * starting an empty one.  Its completely free chunks are purged
+ * first, so any thread that runs out can reuse them.
+ * ================================================================ */
+
+static __thread heap_t *nolock_heap = NULL;
+static unsigned long trim_epoch = 0;  /* bumped by every ts_malloc_trim() */
+
+static pthread_mutex_t orphan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static heap_t *orphan_heaps = NULL;   /* heaps of exited threads */
+static pthread_key_t nolock_key;
+static pthread_once_t nolock_once = PTHREAD_ONCE_INIT;
+
+/* Remote frees are linked through the first word of the user data;
+ * first .. last is an already linked chain of them */
+static void push_remote_frees(heap_t *owner, void *first, void *last) {
+  void *head = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+  do {
+    *(void **)last = head;
+  } while (!__atomic_compare_exchange_n(&owner->remote_frees, &head, first,
+                                        1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
+
+static void push_remote_free(heap_t *owner, void *ptr) {
+  push_remote_frees(owner, ptr, ptr);
+}
+
+static void drain_remote_frees(heap_t *heap) {
+  void *ptr = __atomic_exchange_n(&heap->remote_frees, NULL,
+                                  __ATOMIC_ACQUIRE);
+  while (ptr != NULL) {
+    void *next = *(void **)ptr;
+    unmark_freed(ptr);
+    heap_free(heap, CHUNK_OF(ptr), ptr);
+    ptr = next;
+  }
+}
+
+/* Thread exit: hand the heap to the next thread that needs one */
+static void orphan_heap(void *arg) {
+  heap_t *heap = arg;
+  drain_remote_frees(heap);
+  heap_purge(heap);
+  nolock_heap = NULL;
+
+  pthread_mutex_lock(&orphan_mutex);
+  heap->next_orphan = orphan_heaps;
+  orphan_heaps = heap;
+  pthread_mutex_unlock(&orphan_mutex);
+}
+
+static void nolock_key_create(void) {
+  pthread_key_create(&nolock_key, orphan_heap);
+}
+
+static heap_t *get_nolock_heap(void) {
+  if (nolock_heap == NULL) {
+    pthread_mutex_lock(&orphan_mutex);
+    heap_t *heap = orphan_heaps;
+    if (heap != NULL) {
+      orphan_heaps = heap->next_orphan;
+      heap->next_orphan = NULL;
+    }
+    pthread_mutex_unlock(&orphan_mutex);
+
+    if (heap == NULL && (heap = base_alloc(sizeof(heap_t))) == NULL) {
+      return NULL;
+    }
+    heap->nolock = 1;
+    pthread_once(&nolock_once, nolock_key_create);
+    pthread_setspecific(nolock_key, heap);
+    nolock_heap = heap;
+  }
+  return nolock_heap;
+}
+
+static int nolock_owns(heap_t *heap) {
+  return heap->nolock;
+}
+
+/* Our heap, brought up to date before allocating from it */
+static heap_t *nolock_heap_ready(void) {
+  heap_t *heap = get_nolock_heap();
+  if (heap == NULL) {
+    return NULL;
+  }
+
+  /* Take back memory other threads have freed to us */
+  if (__atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED) != NULL) {
+    drain_remote_frees(heap);
+  }
+
+  /* Some thread asked for a trim since we last looked */
+  unsigned long epoch = __atomic_load_n(&trim_epoch, __ATOMIC_RELAXED);
+  if (heap->trim_epoch != epoch) {
+    heap->trim_epoch = epoch;
+    heap_purge(heap);
+  }
+  return heap;
+}
+
+void *ts_malloc_nolock(size_t size) {
+  if (size == 0 || size > MAX_REQUEST) {
+    return NULL;
+  }
+  if (size >= mmap_threshold) {
+    return stat_alloc(map_large(0, size));
+  }
+
+  heap_t *heap = nolock_heap_ready();
+  if (heap == NULL) {
+    return NULL;
+  }
+
+  /* Allocate from the thread-local heap (no lock needed) */
+  return stat_alloc(heap_alloc(heap, size));
+}
+
+void ts_free_nolock(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  harden_free(ptr, nolock_owns);
+  stat_free(ptr);
+
+  chunk_t *chunk = CHUNK_OF(ptr);
+
+  /* Large blocks go straight back to the kernel */
+  if (chunk->kind == CHUNK_HUGE) {
+    unmap_large(chunk);
+    return;
+  }
+
+  /* Our own memory goes straight back into the local heap */
+  if (chunk->heap == nolock_heap) {
+    heap_free(chunk->heap, chunk, ptr);
+    return;
+  }
+
+  /* Someone else's: hand it back to the owning thread (no lock) */
+  mark_freed(ptr);
+  push_remote_free(chunk->heap, ptr);
+}
+
+void *ts_calloc_nolock(size_t nmemb, size_t size) {
+  size_t bytes = calloc_bytes(nmemb, size);
+  if (bytes == 0) {
+    return NULL;
+  }
+  if (bytes >= mmap_threshold) {
+    return stat_alloc(map_large(0, bytes));
+  }
+
+  heap_t *heap = nolock_heap_ready();
+  if (heap == NULL) {
+    return NULL;
+  }
+  return stat_alloc(heap_calloc(heap, bytes));
+}
+
+void *ts_memalign_nolock(size_t alignment, size_t size) {
+  if (alignment <= ALIGNMENT) {
+    return ts_malloc_nolock(size);
+  }
+  if (bad_alignment(alignment, size)) {
+    return NULL;
+  }
+  if (size + alignment >= mmap_threshold) {
+    return stat_alloc(map_large(alignment, size));
+  }
+
+  heap_t *heap = nolock_heap_ready();
+  if (heap == NULL) {
+    return NULL;
+  }
+  return stat_alloc(heap_memalign(heap, alignment, size));
+}
+
+/* Only memory of our own heap can be resized in place */
+void *ts_realloc_nolock(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return ts_malloc_nolock(size);
+  }
+  if (size == 0) {
+    ts_free_nolock(ptr);
+    return NULL;
+  }
+  if (size > MAX_REQUEST) {
+    return NULL;
+  }
+
+  chunk_t *chunk = CHUNK_OF(ptr);
+  size_t old_size = usable_size(ptr);
+  int in_place = 0;
+  if (chunk->kind == CHUNK_HUGE) {
+    in_place = resize_large(chunk, ptr, size);
+  } else if (chunk->heap == nolock_heap) {
+    in_place = heap_resize(chunk->heap, chunk, ptr, size);
+  }
+
+  if (in_place) {
+    stat_resize(ptr, old_size);
+    return ptr;
+  }
+  return move_allocation(ptr, size, ts_malloc_nolock, ts_free_nolock);
+}
+
+/* Fill ptrs with n blocks; returns how many were stored */
+size_t ts_malloc_batch_nolock(size_t size, void **ptrs, size_t n) {
+  if (size == 0 || size > MAX_REQUEST) {
+    return 0;
+  }
+  if (size >= mmap_threshold) {
+    size_t i = map_large_batch(size, ptrs, n);
+    stat_alloc_batch(ptrs, i);
+    return i;
+  }
+
+  heap_t *heap = nolock_heap_ready();
+  if (heap == NULL) {
+    return 0;
+  }
+
+  size_t i = 0;
+  while (i < n && (ptrs[i] = heap_alloc(heap, size)) != NULL) {
+    i++;
+  }
+  stat_alloc_batch(ptrs, i);
+  return i;
+}
+
+/* Sorted, another thread's memory comes in runs: one CAS per run */
+void ts_free_batch_nolock(void **ptrs, size_t n) {
+  stat_free_batch(ptrs, n);
+  sort_ptrs(ptrs, n);
+
+  void *first = NULL, *last = NULL;
+  heap_t *owner = NULL;
+  for (size_t i = 0; i < n; i++) {
+    if (ptrs[i] == NULL) {
+      continue;
+    }
+
+    harden_free(ptrs[i], nolock_owns);
+    chunk_t *chunk = CHUNK_OF(ptrs[i]);
+    heap_t *heap = chunk->kind == CHUNK_HUGE ? NULL : chunk->heap;
+    if (first != NULL && heap != owner) {
+      push_remote_frees(owner, first, last);
+      first = NULL;
+    }
+
+    if (heap == NULL) {
+      unmap_large(chunk);
+    } else if (heap == nolock_heap) {
+      heap_free(heap, chunk, ptrs[i]);
+    } else if (first == NULL) {
+      mark_freed(ptrs[i]);
+      first = last = ptrs[i];
+      owner = heap;
+    } else {
+      mark_freed(ptrs[i]);
+      *(void **)last = ptrs[i];
+      last = ptrs[i];
+    }
+  }
+  if (first != NULL) {
+    push_remote_frees(owner, first, last);
+  }
+}
+
+/* ================================================================
+ * VERSION 3 — Thread-cached malloc / free
+ *
+ * Strategy: a hybrid of the two versions above.  Each thread keeps
+ * a small, bounded cache of free blocks per size class in
+ * Thread-Local Storage, backed by one shared heap under a mutex.
+ * A cache miss takes the lock once to move a whole batch of blocks
+ * into the cache; a cache that overflows hands a batch back.
+ * Most calls take no lock, and memory freed by one thread still
+ * reaches every other thread through the shared heap.  A thread's
+ * cache is emptied back into the shared heap when it exits.
+ *
+ * A block malloc, calloc or realloc hands out for a cached size is
+ * exactly the size its class stands for, so a sized free knows the
+ * block's class and usable bytes without reading its header.
+ * ================================================================ */
+
+#define TCACHE_QUANTUM 16                               /* class spacing     */
+#define TCACHE_CLASSES 64                               /* 32 .. 1040 bytes  */
+#define TCACHE_MAX     (MIN_BLOCK + TCACHE_QUANTUM * (TCACHE_CLASSES - 1))
+#define TCACHE_BATCH   16                               /* blocks per refill */
+#define TCACHE_LIMIT   (2 * TCACHE_BATCH)               /* blocks per class  */
+
+typedef struct tcache {
+  block_t *head[TCACHE_CLASSES];   /* cached blocks, linked through next */
+  unsigned count[TCACHE_CLASSES];
+} tcache_t;
+
+static heap_t tcache_heap;
+static ts_lock_t tcache_mutex = LOCK_INITIALIZER(LOCK_HEAP);
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static __thread int tcache_registered = 0;
+
+/* Cached blocks stay allocated as far as the shared heap is concerned */
+static inline void tcache_push(size_t cls, block_t *block) {
+  if (harden_on()) {
+    block->prev = (block_t *)harden_key;
+  }
+  block->next = tcache.head[cls];
+  tcache.head[cls] = block;
+  tcache.count[cls]++;
+}
+
+static inline block_t *tcache_pop(size_t cls) {
+  block_t *block = tcache.head[cls];
+  if (harden_on()) {
+    check_header(block);
+    if ((size_t)block->prev != harden_key) {
+      harden_fail("corrupted thread cache", block_data(block));
+    }
+    block->prev = NULL;
+  }
+  tcache.head[cls] = block->next;
+  tcache.count[cls]--;
+  return block;
+}
+
+static int tcache_owns(heap_t *heap) {
+  return heap == &tcache_heap;
+}
+
+/* Return every cached block to the shared heap; tcache_mutex must be held */
+static void tcache_drain(void) {
+  for (size_t cls = 0; cls < TCACHE_CLASSES; cls++) {
+    while (tcache.head[cls] != NULL) {
+      insert_free_block(&tcache_heap, tcache_pop(cls));
+    }
+  }
+}
+
+/* Thread exit: nothing else will ever take blocks from this cache */
+static void tcache_exit(void *arg) {
+  (void)arg;
+  tcache_registered = 0;
+  lock_acquire(&tcache_mutex);
+  tcache_drain();
+  lock_release(&tcache_mutex);
+}
+
+static void tcache_key_create(void) {
+  pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/* The key's value only has to be non-NULL for tcache_exit to run */
+static void tcache_register(void) {
+  pthread_once(&tcache_once, tcache_key_create);
+  pthread_setspecific(tcache_key, &tcache);
+  tcache_registered = 1;
+}
+
+/* Carve one batch of class-sized blocks out of a single heap block.
+ * The pieces are cut under the lock, since freeing a neighbour may
+ * rewrite the flags of the first one. */
+static void tcache_refill(size_t cls) {
+  if (!tcache_registered) {
+    tcache_register();
+  }
+
+  size_t size = MIN_BLOCK + cls * TCACHE_QUANTUM;
+
+  lock_acquire(&tcache_mutex);
+  block_t *block = best_fit_search(&tcache_heap, TCACHE_BATCH * size);
+  if (block == NULL) {
+    block = extend_heap(&tcache_heap, TCACHE_BATCH * size);
+  }
+
+  if (block != NULL) {
+    /* The last piece keeps any slack the heap block came with, which
+     * makes it a class of its own, or too big to cache */
+    size_t total = block_size(block);
+    for (int i = 0; i < TCACHE_BATCH - 1; i++) {
+      set_header(block, size | BLOCK_ALLOC |
+                        (block_header(block) & BLOCK_PREV_ALLOC));
+      total -= size;
+      block_t *next = next_block(block);
+      tcache_push(cls, block);
+      block = next;
+      set_header(block, BLOCK_PREV_ALLOC);
+    }
+    set_header(block, total | BLOCK_ALLOC | BLOCK_PREV_ALLOC);
+    if (total <= TCACHE_MAX) {
+      tcache_push((total - MIN_BLOCK) / TCACHE_QUANTUM, block);
+    } else {
+      insert_free_block(&tcache_heap, block);
+    }
+  }
+  lock_release(&tcache_mutex);
+}
+
+/* Return half of an overflowing class to the shared heap */
+static void tcache_flush(size_t cls) {
+  lock_acquire(&tcache_mutex);
+  while (tcache.count[cls] > TCACHE_LIMIT - TCACHE_BATCH) {
+    block_t *block = tcache_pop(cls);
+    size_t size = block_size(block);
+    insert_free_block(&tcache_heap, block);
+    heap_freed(&tcache_heap, size);
+  }
+  lock_release(&tcache_mutex);
+}
+
+void *ts_malloc_tcache(size_t size) {
+  if (size == 0 || size > MAX_REQUEST) {
+    return NULL;
+  }
+  if (size >= mmap_threshold) {
+    return stat_alloc(map_large(0, size));
+  }
+
+  /* Large requests go straight to the shared heap */
+  size = request_size(size);
+  if (size > TCACHE_MAX) {
+    lock_acquire(&tcache_mutex);
+    block_t *block = best_fit_search(&tcache_heap, size);
+    if (block == NULL) {
+      block = extend_heap(&tcache_heap, size);
+    }
+    lock_release(&tcache_mutex);
+    return block != NULL ? stat_alloc(block_data(block)) : NULL;
+  }
+
+  /* Block sizes are whole classes, so every cached block fits */
+  size_t cls = (size - MIN_BLOCK) / TCACHE_QUANTUM;
+  if (tcache.head[cls] == NULL) {
+    tcache_refill(cls);
+    if (tcache.head[cls] == NULL) {
+      return NULL;
+    }
+  }
+  return stat_alloc(block_data(tcache_pop(cls)));
+}
+
+void ts_free_tcache(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  harden_free(ptr, tcache_owns);
+  stat_free(ptr);
+
+  chunk_t *chunk = CHUNK_OF(ptr);
+
+  /* Large blocks go straight back to the kernel */
+  if (chunk->kind == CHUNK_HUGE) {
+    unmap_large(chunk);
+    return;
+  }
+
+  block_t *block = data_block(ptr);
+  size_t size = block_size(block);
+
+  /* Round down, so the block is big enough for its class */
+  if (size >= TCACHE_MAX + TCACHE_QUANTUM) {
+    lock_acquire(&tcache_mutex);
+    insert_free_block(&tcache_heap, block);
+    heap_freed(&tcache_heap, size);
+    lock_release(&tcache_mutex);
+    return;
+  }
+
+  size_t cls = (size - MIN_BLOCK) / TCACHE_QUANTUM;
+  if (!tcache_registered) {
+    tcache_register();
+  }
+  tcache_push(cls, block);
+  if (tcache.count[cls] > TCACHE_LIMIT) {
+    tcache_flush(cls);
+  }
+}
+
+/* The size names the block's class, and with it the bytes to count,
+ * without a look at its header */
+void ts_free_sized_tcache(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+  check_free_size(ptr, size);
+
+  size_t total = request_size(size);
+  if (size > TCACHE_MAX || total > TCACHE_MAX ||
+      CHUNK_OF(ptr)->kind == CHUNK_HUGE) {
+    ts_free_tcache(ptr);
+    return;
+  }
+  harden_free(ptr, tcache_owns);
+  stat_free_size(ptr, total - HEADER_SIZE);
+
+  size_t cls = (total - MIN_BLOCK) / TCACHE_QUANTUM;
+  if (!tcache_registered) {
+    tcache_register();
+  }
+  tcache_push(cls, data_block(ptr));
+  if (tcache.count[cls] > TCACHE_LIMIT) {
+    tcache_flush(cls);
+  }
+}
+
+/* Cached blocks have all been used; only the shared heap may hold
+ * blocks that are still zero */
+void *ts_calloc_tcache(size_t nmemb, size_t size) {
+  size_t bytes = calloc_bytes(nmemb, size);
+  if (bytes == 0) {
+    return NULL;
+  }
+  if (bytes >= mmap_threshold) {
+    return stat_alloc(map_large(0, bytes));
+  }
+
+  size_t total = request_size(bytes);
+  if (total <= TCACHE_MAX) {
+    void *ptr = ts_malloc_tcache(bytes);
+    if (ptr != NULL) {
+      memset(ptr, 0, bytes);
+    }
+    return ptr;
+  }
+
+  int zero;
+  lock_acquire(&tcache_mutex);
+  block_t *block = heap_take(&tcache_heap, total, &zero);
+  lock_release(&tcache_mutex);
+  return block != NULL ? stat_alloc(block_clear(block, zero, bytes)) : NULL;
+}
+
+/* Aligned blocks bypass the cache on the way out, not on the way back */
+void *ts_memalign_tcache(size_t alignment, size_t size) {
+  if (alignment <= ALIGNMENT) {
+    return ts_malloc_tcache(size);
+  }
+  if (bad_alignment(alignment, size)) {
+    return NULL;
+  }
+  if (size + alignment >= mmap_threshold) {
+    return stat_alloc(map_large(alignment, size));
+  }
+
+  lock_acquire(&tcache_mutex);
+  block_t *block = block_memalign(&tcache_heap, alignment, size);
+  lock_release(&tcache_mutex);
+  return block != NULL ? stat_alloc(block_data(block)) : NULL;
+}
+
+void *ts_realloc_tcache(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return ts_malloc_tcache(size);
+  }
+  if (size == 0) {
+    ts_free_tcache(ptr);
+    return NULL;
+  }
+  if (size > MAX_REQUEST) {
+    return NULL;
+  }
+
+  chunk_t *chunk = CHUNK_OF(ptr);
+  size_t old_size = usable_size(ptr);
+  int in_place;
+  if (chunk->kind == CHUNK_HUGE) {
+    in_place = resize_large(chunk, ptr, size);
+  } else {
+    /* A block for a cached size must come out exact: it stays put only
+     * if it is, or a split can make it, that size */
+    block_t *block = data_block(ptr);
+    size_t total = request_size(size);
+    size_t slack = block_size(block) - total;
+    lock_acquire(&tcache_mutex);
+    in_place = (total > TCACHE_MAX ||
+                (block_size(block) >= total &&
+                 (slack == 0 || slack >= MIN_SPLIT))) &&
+               resize_block(&tcache_heap, block, total);
+    lock_release(&tcache_mutex);
+  }
+
+  if (in_place) {
+    stat_resize(ptr, old_size);
+    return ptr;
+  }
+  return move_allocation(ptr, size, ts_malloc_tcache, ts_free_tcache);
+}
+
+/* Fill ptrs with n blocks; the cache refills a batch per lock */
+size_t ts_malloc_batch_tcache(size_t size, void **ptrs, size_t n) {
+  if (size == 0 || size > MAX_REQUEST) {
+    return 0;
+  }
+  if (size >= mmap_threshold) {
+    size_t i = map_large_batch(size, ptrs, n);
+    stat_alloc_batch(ptrs, i);
+    return i;
+  }
+
+  size_t i = 0;
+  size = request_size(size);
+  if (size > TCACHE_MAX) {
+    lock_acquire(&tcache_mutex);
+    for (; i < n; i++) {
+      block_t *block = best_fit_search(&tcache_heap, size);
+      if (block == NULL && (block = extend_heap(&tcache_heap, size)) == NULL) {
+        break;
+      }
+      ptrs[i] = block_data(block);
+    }
+    lock_release(&tcache_mutex);
+    stat_alloc_batch(ptrs, i);
+    return i;
+  }
+
+  size_t cls = (size - MIN_BLOCK) / TCACHE_QUANTUM;
+  for (; i < n; i++) {
+    if (tcache.head[cls] == NULL) {
+      tcache_refill(cls);
+      if (tcache.head[cls] == NULL) {
+        break;
+      }
+    }
+    ptrs[i] = block_data(tcache_pop(cls));
+  }
+  stat_alloc_batch(ptrs, i);
+  return i;
+}
+
+/* Whatever the cache has no room for goes back under one lock */
+void ts_free_batch_tcache(void **ptrs, size_t n) {
+  stat_free_batch(ptrs, n);
+  sort_ptrs(ptrs, n);
+  if (!tcache_registered) {
+    tcache_register();
+  }
+
+  size_t rest = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (ptrs[i] == NULL) {
+      continue;
+    }
+
+    harden_free(ptrs[i], tcache_owns);
+    chunk_t *chunk = CHUNK_OF(ptrs[i]);
+    if (chunk->kind == CHUNK_HUGE) {
+      unmap_large(chunk);
+      continue;
+    }
+
+    block_t *block = data_block(ptrs[i]);
+    size_t size = block_size(block);
+    size_t cls = (size - MIN_BLOCK) / TCACHE_QUANTUM;
+    if (size < TCACHE_MAX + TCACHE_QUANTUM &&
+        tcache.count[cls] < TCACHE_LIMIT) {
+      tcache_push(cls, block);
+    } else {
+      ptrs[rest++] = ptrs[i];
+    }
+  }
+
+  if (rest == 0) {
+    return;
+  }
+  lock_acquire(&tcache_mutex);
+  for (size_t i = 0; i < rest; i++) {
+    block_t *block = data_block(ptrs[i]);
+    size_t size = block_size(block);
+    insert_free_block(&tcache_heap, block);
+    heap_freed(&tcache_heap, size);
+  }
+  lock_release(&tcache_mutex);
+}
+
+/* ================================================================
+ * VERSION 4 — Lock-free malloc / free
+ *
+ * Strategy: one shared pool per size class, with no lock at all on
+ * the allocation path.  Each class keeps a Treiber stack of free
+ * objects whose head is a pointer paired with a version tag and
+ * updated with a double-width CAS, so a head that was popped and
+ * pushed back in the meantime (ABA) still fails the exchange.  A
+ * class with an empty stack carves new objects off its current
+ * chunk with the same CAS on a (cursor, end) pair; the thread that
+ * finds the chunk used up maps the next one, and only the arena
+ * layer's mutex is taken then, once per chunk.
+ *
+ * Objects carry no header: every chunk holds a single class, named
+ * in its header.  Memory stays type-stable — once carved, an object
+ * only ever moves between its class stack and the application, and
+ * is never purged — so a popper may always read the next link of a
+ * head another thread has just taken.
+ *
+ * Classes are 16 bytes apart up to 1024 bytes and two per power of
+ * two above, up to MAX_MMAP_THRESHOLD.  Objects of a class whose
+ * size is a power of two are aligned to their size, which is how
+ * aligned requests are served.
+ * ================================================================ */
+
+#define LF_QUANTUM 16
+#define LF_SMALL   64                           /* 16 .. 1024 bytes  */
+#define LF_CLASSES (LF_SMALL + 2 * 10)          /* .. 1 MiB          */
+
+_Static_assert(MAX_MMAP_THRESHOLD <= (1UL << 20),
+               "lock-free classes must reach MAX_MMAP_THRESHOLD");
+
+/* A pointer and a version tag, exchanged as one 16-byte word */
+typedef union lf_word {
+  struct {
+    char *ptr;
+    uintptr_t tag;   /* stack: version; carving: end of the chunk */
+  };
+  unsigned __int128 word;
+} __attribute__((aligned(16))) lf_word_t;
+
+typedef struct lf_class {
+  lf_word_t free;    /* free objects, linked through the first word */
+  lf_word_t carve;   /* next uncarved object and end of its chunk   */
+} __attribute__((aligned(CACHE_LINE))) lf_class_t;
+
+typedef struct lf_chunk {
+  chunk_t hdr;
+  unsigned cls;
+} lf_chunk_t;
+
+static lf_class_t lf_classes[LF_CLASSES];
+
+static size_t lf_class_index(size_t size) {
+  if (size <= LF_SMALL * LF_QUANTUM) {
+    return (size - 1) / LF_QUANTUM;
+  }
+  size_t msb = 63 - __builtin_clzl(size - 1);
+  return LF_SMALL + (msb - 10) * 2 + (size > (3UL << (msb - 1)));
+}
+
+static size_t lf_class_size(size_t cls) {
+  if (cls < LF_SMALL) {
+    return (cls + 1) * LF_QUANTUM;
+  }
+  size_t msb = 10 + (cls - LF_SMALL) / 2;
+  return (cls - LF_SMALL) % 2 ? 2UL << msb : 3UL << (msb - 1);
+}
+
+/* Torn reads are harmless: the CAS that follows rejects them */
+static inline lf_word_t lf_load(lf_word_t *w) {
+  lf_word_t v;
+  v.tag = __atomic_load_n(&w->tag, __ATOMIC_ACQUIRE);
+  v.ptr = __atomic_load_n(&w->ptr, __ATOMIC_ACQUIRE);
+  return v;
+}
+
+static inline int lf_cas(lf_word_t *w, lf_word_t old, lf_word_t new) {
+  return __sync_bool_compare_and_swap(&w->word, old.word, new.word);
+}
+
+static void *lf_pop(lf_class_t *c) {
+  lf_word_t old = lf_load(&c->free), new;
+  do {
+    if (old.ptr == NULL) {
+      return NULL;
+    }
+    new.ptr = __atomic_load_n((char **)old.ptr, __ATOMIC_RELAXED);
+    new.tag = old.tag + 1;
+    if (lf_cas(&c->free, old, new)) {
+      return old.ptr;
+    }
+    old = lf_load(&c->free);
+  } while (1);
+}
+
+/* first .. last is an already linked chain of free objects */
+static void lf_push_chain(lf_class_t *c, void *first, void *last) {
+  lf_word_t old = lf_load(&c->free), new;
+  new.ptr = first;
+  do {
+    __atomic_store_n((char **)last, old.ptr, __ATOMIC_RELAXED);
+    new.tag = old.tag + 1;
+    if (lf_cas(&c->free, old, new)) {
+      return;
+    }
+    old = lf_load(&c->free);
+  } while (1);
+}
+
+static void lf_push(lf_class_t *c, void *ptr) {
+  lf_push_chain(c, ptr, ptr);
+}
+
+/* Carve a fresh object, starting a new chunk when the current one is full */
+static void *lf_carve(size_t cls) {
+  lf_class_t *c = &lf_classes[cls];
+  size_t size = lf_class_size(cls);
+  lf_word_t old = lf_load(&c->carve), new;
+
+  do {
+    if (old.ptr != NULL && old.ptr + size <= (char *)old.tag) {
+      new.ptr = old.ptr + size;
+      new.tag = old.tag;
+      if (lf_cas(&c->carve, old, new)) {
+        return old.ptr;
+      }
+      old = lf_load(&c->carve);
+      continue;
+    }
+
+    lf_chunk_t *chunk = (lf_chunk_t *)arena_alloc(CHUNK_LOCKFREE, NULL);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->cls = cls;
+
+    /* Objects are aligned to the largest power of two dividing the size */
+    size_t align = size & -size;
+    char *start = (char *)(((uintptr_t)(chunk + 1) + align - 1) &
+                           ~(align - 1));
+    new.ptr = start + size;
+    new.tag = (uintptr_t)chunk + CHUNK_SIZE;
+    if (lf_cas(&c->carve, old, new)) {
+      return start;
+    }
+
+    /* Someone else started a chunk first: keep theirs, spare ours */
+    arena_release(&chunk->hdr);
+    old = lf_load(&c->carve);
+  } while (1);
+}
+
+static void *lf_alloc(size_t cls) {
+  void *ptr = lf_pop(&lf_classes[cls]);
+  if (ptr == NULL) {
+    return lf_carve(cls);
+  }
+  unmark_freed(ptr);
+  return ptr;
+}
+
+void *ts_malloc_lockfree(size_t size) {
+  if (size == 0 || size > MAX_REQUEST) {
+    return NULL;
+  }
+  if (size >= mmap_threshold) {
+    return stat_alloc(map_large(0, size));
+  }
+  return stat_alloc(lf_alloc(lf_class_index(size)));
+}
+
+void ts_free_lockfree(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  harden_free(ptr, NULL);
+  stat_free(ptr);
+
+  chunk_t *chunk = CHUNK_OF(ptr);
+
+  /* Large blocks go straight back to the kernel */
+  if (chunk->kind == CHUNK_HUGE) {
+    unmap_large(chunk);
+    return;
+  }
+
+  mark_freed(ptr);
+  lf_push(&lf_classes[((lf_chunk_t *)chunk)->cls], ptr);
+}
+
+/* The size names the object's class, and with it the bytes to count,
+ * without a look at its chunk */
+void ts_free_sized_lockfree(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+  check_free_size(ptr, size);
+  if (size >= mmap_threshold) {
+    ts_free_lockfree(ptr);
+    return;
+  }
+  harden_free(ptr, NULL);
+
+  size_t cls = lf_class_index(size);
+  stat_free_size(ptr, lf_class_size(cls));
+  mark_freed(ptr);
+  lf_push(&lf_classes[cls], ptr);
+}
+
+/* Objects carved from a chunk have never been used */
+void *ts_calloc_lockfree(size_t nmemb, size_t size) {
+  size_t bytes = calloc_bytes(nmemb, size);
+  if (bytes == 0) {
+    return NULL;
+  }
+  if (bytes >= mmap_threshold) {
+    return stat_alloc(map_large(0, bytes));
+  }
+
+  size_t cls = lf_class_index(bytes);
+  void *ptr = lf_pop(&lf_classes[cls]);
+  if (ptr != NULL) {
+    unmark_freed(ptr);
+    memset(ptr, 0, bytes);
+  } else {
+    ptr = lf_carve(cls);
+  }
+  return stat_alloc(ptr);
+}
+
+/* A power-of-two class at least as large as the alignment is aligned */
+void *ts_memalign_lockfree(size_t alignment, size_t size) {
+  if (alignment <= LF_QUANTUM) {
+    return ts_malloc_lockfree(size);
+  }
+  if (bad_alignment(alignment, size)) {
+    return NULL;
+  }
+
+  size_t pow2 = size > alignment ? size : alignment;
+  pow2 = 1UL << (64 - __builtin_clzl(pow2 - 1));
+  if (pow2 >= mmap_threshold) {
+    return stat_alloc(map_large(alignment, size));
+  }
+  return stat_alloc(lf_alloc(lf_class_index(pow2)));
+}
+
+/* An object stays put only within its class, so the size it is
+ * freed with still names it */
+void *ts_realloc_lockfree(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return ts_malloc_lockfree(size);
+  }
+  if (size == 0) {
+    ts_free_lockfree(ptr);
+    return NULL;
+  }
+  if (size > MAX_REQUEST) {
+    return NULL;
+  }
+
+  chunk_t *chunk = CHUNK_OF(ptr);
+  size_t old_size = usable_size(ptr);
+  int in_place;
+  if (chunk->kind == CHUNK_HUGE) {
+    in_place = resize_large(chunk, ptr, size);
+  } else {
+    in_place = lf_class_index(size) == ((lf_chunk_t *)chunk)->cls;
+  }
+
+  if (in_place) {
+    stat_resize(ptr, old_size);
+    return ptr;
+  }
+  return move_allocation(ptr, size, ts_malloc_lockfree, ts_free_lockfree);
+}
+
+/* Fill ptrs with n objects; returns how many were stored */
+size_t ts_malloc_batch_lockfree(size_t size, void **ptrs, size_t n) {
+  if (size == 0 || size > MAX_REQUEST) {
+    return 0;
+  }
+  if (size >= mmap_threshold) {
+    size_t i = map_large_batch(size, ptrs, n);
+    stat_alloc_batch(ptrs, i);
+    return i;
+  }
+
+  size_t i = 0, cls = lf_class_index(size);
+  while (i < n && (ptrs[i] = lf_alloc(cls)) != NULL) {
+    i++;
+  }
+  stat_alloc_batch(ptrs, i);
+  return i;
+}
+
+/* Sorted, each chunk's objects come in runs: one CAS per run */
+void ts_free_batch_lockfree(void **ptrs, size_t n) {
+  stat_free_batch(ptrs, n);
+  sort_ptrs(ptrs, n);
+
+  void *first = NULL, *last = NULL;
+  lf_chunk_t *run = NULL;
+  for (size_t i = 0; i < n; i++) {
+    if (ptrs[i] == NULL) {
+      continue;
+    }
+
+    harden_free(ptrs[i], NULL);
+    chunk_t *chunk = CHUNK_OF(ptrs[i]);
+    if (first != NULL && (lf_chunk_t *)chunk != run) {
+      lf_push_chain(&lf_classes[run->cls], first, last);
+      first = NULL;
+    }
+
+    if (chunk->kind == CHUNK_HUGE) {
+      unmap_large(chunk);
+    } else if (first == NULL) {
+      mark_freed(ptrs[i]);
+      first = last = ptrs[i];
+      run = (lf_chunk_t *)chunk;
+    } else {
+      mark_freed(ptrs[i]);
+      *(void **)last = ptrs[i];
+      last = ptrs[i];
+    }
+  }
+  if (first != NULL) {
+    lf_push_chain(&lf_classes[run->cls], first, last);
+  }
+}
+
+/* ================================================================
+ * Regions (ts_arena_*)
+ *
+ * Strategy: a region hands out memory by bumping a pointer through
+ * large blocks taken from a private heap, and never frees anything
+ * on its own.  Reset gives each of those blocks back with a single
+ * insert_free_block, so they coalesce into whole chunks that the
+ * next round reuses; destroy also purges the heap, which sends the
+ * chunks to the arena layer's spare list.  Teardown is O(blocks)
+ * however many objects were allocated.
+ *
+ * Requests of mmap_threshold bytes or more get a mapping of their
+ * own, linked into the region and unmapped on reset.  A region is
+ * not itself thread-safe: one thread at a time may use it.
+ * ================================================================ */
+
+#define REGION_BLOCK (64UL << 10)   /* smallest block a region takes */
+
+struct ts_arena {
+  heap_t heap;          /* where the region's blocks come from    */
+  block_t *blocks;      /* blocks in use, newest first            */
+  void *large;          /* own mappings, linked through the first
+                           word in front of the data              */
+  char *cur;            /* bump pointer in the newest block       */
+  char *end;
+  struct ts_arena *next_free;   /* on region_free once destroyed   */
+};
+
+static pthread_mutex_t region_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ts_arena_t *region_free = NULL;    /* destroyed, for reuse */
+
+ts_arena_t *ts_arena_create(void) {
+  pthread_mutex_lock(&region_mutex);
+  ts_arena_t *region = region_free;
+  if (region != NULL) {
+    region_free = region->next_free;
+  }
+  pthread_mutex_unlock(&region_mutex);
+
+  if (region == NULL) {
+    return base_alloc(sizeof(ts_arena_t));
+  }
+  memset(region, 0, sizeof(*region));
+  return region;
+}
+
+/* Start a new block big enough for size bytes after its link word */
+static int region_grow(ts_arena_t *region, size_t size) {
+  size_t want = request_size(ALIGNMENT + size);
+  if (want < REGION_BLOCK) {
+    want = REGION_BLOCK;
+  }
+
+  block_t *block = best_fit_search(&region->heap, want);
+  if (block == NULL && (block = extend_heap(&region->heap, want)) == NULL) {
+    return 0;
+  }
+
+  char *data = block_data(block);
+  *(block_t **)data = region->blocks;
+  region->blocks = block;
+  region->cur = data + ALIGNMENT;
+  region->end = (char *)block + block_size(block);
+  return 1;
+}
+
+void *ts_arena_alloc(ts_arena_t *region, size_t size) {
+  if (size == 0 || size > MAX_REQUEST) {
+    return NULL;
+  }
+
+  if (size >= mmap_threshold) {
+    char *mem = map_large(0, ALIGNMENT + size);
+    if (mem == NULL) {
+      return NULL;
+    }
+    *(void **)mem = region->large;
+    region->large = mem;
+    return mem + ALIGNMENT;
+  }
+
+  size = ALIGN_UP(size);
+  if ((size_t)(region->end - region->cur) < size &&
+      !region_grow(region, size)) {
+    return NULL;
+  }
+  void *ptr = region->cur;
+  region->cur += size;
+  return ptr;
+}
+
+/* Free everything in the region at once, keeping its chunks */
+void ts_arena_reset(ts_arena_t *region) {
+  while (region->blocks != NULL) {
+    block_t *block = region->blocks;
+    region->blocks = *(block_t **)block_data(block);
+    insert_free_block(&region->heap, block);
+  }
+  while (region->large != NULL) {
+    void *mem = region->large;
+    region->large = *(void **)mem;
+    unmap_large(CHUNK_OF(mem));
+  }
+  region->cur = NULL;
+  region->end = NULL;
+}
+
+void ts_arena_destroy(ts_arena_t *region) {
+  if (region == NULL) {
+    return;
+  }
+  ts_arena_reset(region);
+  heap_purge(&region->heap);
+
+  pthread_mutex_lock(&region_mutex);
+  region->next_free = region_free;
+  region_free = region;
+  pthread_mutex_unlock(&region_mutex);
+}
+
+/* ================================================================
+ * Fork
+ *
+ * A child starts out with only the thread that called fork(), so a
+ * lock some other thread held at that moment would stay held for
+ * good and the child's first malloc could wait on it forever.  So
+ * fork() first takes every allocator lock, in the order the
+ * allocator nests them: the profile (whose dump may allocate), the
+ * region and orphan lists, the lock arenas and the thread cache's
+ * heap, the chunk lock they take to grow, and last the statistics,
+ * which any of them may take.  The parent lets them go once the
+ * address space is copied.  The child resets its ts_lock_t instead:
+ * threads queued on a ticket or MCS lock at the fork are not there
+ * to take their turn.  What other threads held in their own caches
+ * and heaps stays theirs, and in the child is never freed.
+ * ================================================================ */
+_Static_assert(LOCK_FORK_NODES >= MAX_LOCK_ARENAS + 2,
+               "fork() needs an MCS node for every lock it holds");
+
+static void fork_prepare(void) {
+  pthread_mutex_lock(&prof_mutex);
+  pthread_mutex_lock(&region_mutex);
+  pthread_mutex_lock(&orphan_mutex);
+
+  /* prof_mutex already keeps a second fork() out of the shared nodes */
+  lock_forking = 1;
+  for (unsigned i = 0; i < lock_arena_count; i++) {
+    lock_acquire(&lock_arenas[i].lock);
+  }
+  lock_acquire(&tcache_mutex);
+  lock_acquire(&arena_mutex);
+  lock_forking = 0;
+
+  pthread_mutex_lock(&stats_mutex);
+}
+
+static void fork_parent(void) {
+  pthread_mutex_unlock(&stats_mutex);
+  lock_release(&arena_mutex);
+  lock_release(&tcache_mutex);
+  for (unsigned i = lock_arena_count; i-- > 0;) {
+    lock_release(&lock_arenas[i].lock);
+  }
+  pthread_mutex_unlock(&orphan_mutex);
+  pthread_mutex_unlock(&region_mutex);
+  pthread_mutex_unlock(&prof_mutex);
+}
+
+static void fork_child(void) {
+  pthread_mutex_unlock(&stats_mutex);
+  lock_reset(&arena_mutex);
+  lock_reset(&tcache_mutex);
+  for (unsigned i = 0; i < lock_arena_count; i++) {
+    lock_reset(&lock_arenas[i].lock);
+  }
+  memset(lock_fork_nodes, 0, sizeof(lock_fork_nodes));
+  pthread_mutex_unlock(&orphan_mutex);
+  pthread_mutex_unlock(&region_mutex);
+  pthread_mutex_unlock(&prof_mutex);
+}
+
+__attribute__((constructor)) static void init_fork(void) {
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/* ================================================================
+ * Engine dispatch (ts_malloc, ts_free, ...)
+ *
+ * Strategy: one set of entry points that forwards to whichever
+ * version is configured, so the same binary can run any of them.
+ * The engine is a table of function pointers, chosen once — by
+ * ts_malloc_set_engine() or else, on the first call, from the
+ * TS_MALLOC_ENGINE environment variable (nolock by default) — and
+ * never changed again, since each version only frees its own
+ * memory.  After that a call costs one load and an indirect jump.
+ * The first call may come from the dynamic loader, long before
+ * main() or any constructor has run.
+ * ================================================================ */
+
+typedef struct engine {
+  const char *name;
+  void *(*malloc)(size_t size);
+  void (*free)(void *ptr);
+  void (*free_sized)(void *ptr, size_t size);   /* NULL: free */
+  void *(*calloc)(size_t nmemb, size_t size);
+  void *(*memalign)(size_t alignment, size_t size);
+  void *(*realloc)(void *ptr, size_t size);
+  size_t (*malloc_batch)(size_t size, void **ptrs, size_t n);
+  void (*free_batch)(void **ptrs, size_t n);
+} engine_t;
+
+static const engine_t engines[] = {
+  { "nolock", ts_malloc_nolock, ts_free_nolock,
+    NULL, ts_calloc_nolock,
+    ts_memalign_nolock, ts_realloc_nolock,
+    ts_malloc_batch_nolock, ts_free_batch_nolock },
+  { "lock", ts_malloc_lock, ts_free_lock,
+    NULL, ts_calloc_lock,
+    ts_memalign_lock, ts_realloc_lock,
+    ts_malloc_batch_lock, ts_free_batch_lock },
+  { "tcache", ts_malloc_tcache, ts_free_tcache,
+    ts_free_sized_tcache, ts_calloc_tcache,
+    ts_memalign_tcache, ts_realloc_tcache,
+    ts_malloc_batch_tcache, ts_free_batch_tcache },
+  { "lockfree", ts_malloc_lockfree, ts_free_lockfree,
+    ts_free_sized_lockfree, ts_calloc_lockfree,
+    ts_memalign_lockfree, ts_realloc_lockfree,
+    ts_malloc_batch_lockfree, ts_free_batch_lockfree },
+};
+
+static const engine_t *engine = NULL;
+
+static const engine_t *engine_lookup(const char *name) {
+  size_t count = sizeof(engines) / sizeof(engines[0]);
+  for (size_t i = 0; name != NULL && i < count; i++) {
+    if (strcasecmp(name, engines[i].name) == 0) {
+      return &engines[i];
+    }
+  }
+  return NULL;
+}
+
+/* Fix the engine to e unless one is already in place; returns that */
+static const engine_t *engine_install(const engine_t *e) {
+  const engine_t *expected = NULL;
+  if (!__atomic_compare_exchange_n(&engine, &expected, e, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    return expected;
+  }
+  return e;
+}
+
+static const engine_t *engine_resolve(void) {
+  const engine_t *e = engine_lookup(getenv("TS_MALLOC_ENGINE"));
+  return engine_install(e != NULL ? e : &engines[0]);
+}
+
+static inline const engine_t *get_engine(void) {
+  const engine_t *e = __atomic_load_n(&engine, __ATOMIC_ACQUIRE);
+  return e != NULL ? e : engine_resolve();
+}
+
+int ts_malloc_set_engine(const char *name) {
+  const engine_t *e = engine_lookup(name);
+  if (e == NULL) {
+    return -1;
+  }
+  return engine_install(e) == e ? 0 : -1;
+}
+
+const char *ts_malloc_engine(void) {
+  return get_engine()->name;
+}
+
+void *ts_malloc(size_t size) {
+  return get_engine()->malloc(size);
+}
+
+void ts_free(void *ptr) {
+  get_engine()->free(ptr);
+}
+
+/* A version without a sized free has nothing to gain from the size */
+void ts_free_sized(void *ptr, size_t size) {
+  const engine_t *e = get_engine();
+  if (e->free_sized != NULL) {
+    e->free_sized(ptr, size);
+  } else if (ptr != NULL) {
+    check_free_size(ptr, size);
+    e->free(ptr);
+  }
+}
+
+void *ts_calloc(size_t nmemb, size_t size) {
+  return get_engine()->calloc(nmemb, size);
+}
+
+void *ts_memalign(size_t alignment, size_t size) {
+  return get_engine()->memalign(alignment, size);
+}
+
+void *ts_aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    return NULL;
+  }
+  return ts_memalign(alignment, size);
+}
+
+int ts_posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  if (size == 0) {
+    *memptr = NULL;
+    return 0;
+  }
+  void *ptr = ts_memalign(alignment, size);
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+void *ts_realloc(void *ptr, size_t size) {
+  return get_engine()->realloc(ptr, size);
+}
+
+size_t ts_malloc_batch(size_t size, void **ptrs, size_t n) {
+  return get_engine()->malloc_batch(size, ptrs, n);
+}
+
+void ts_free_batch(void **ptrs, size_t n) {
+  get_engine()->free_batch(ptrs, n);
+}
+
+/* ================================================================
+ * Introspection shared by all versions
+ * ================================================================ */
+
+size_t ts_malloc_usable_size(void *ptr) {
+  return ptr != NULL ? usable_size(ptr) : 0;
+}
+
+static size_t usable_size(void *ptr) {
+  chunk_t *chunk = CHUNK_OF(ptr);
+  switch (chunk->kind) {
+  case CHUNK_HUGE:
+    return (char *)chunk + chunk->size - (char *)ptr;
+  case CHUNK_SLABS:
+    return slab_of(chunk, ptr)->size;
+  case CHUNK_LOCKFREE:
+    return lf_class_size(((lf_chunk_t *)chunk)->cls);
+  default:
+    return block_size(data_block(ptr)) - HEADER_SIZE;
+  }
+}
+
+/* The pointer must be aligned and in a chunk of ours of a kind the
+ * freeing version hands out, from a heap it owns, and start an object
+ * or block that is still in use */
+static void check_free(void *ptr, int (*owns)(heap_t *heap)) {
+  chunk_t *chunk = CHUNK_OF(ptr);
+  size_t offset = (char *)ptr - (char *)chunk;
+  if ((uintptr_t)ptr % ALIGNMENT != 0) {
+    harden_fail("free of an invalid pointer", ptr);
+  }
+
+  switch (chunk->kind) {
+  case CHUNK_HUGE:
+    if (offset < HUGE_OFFSET || offset > CHUNK_SIZE ||
+        (offset & (offset - 1)) != 0) {
+      harden_fail("free of an invalid pointer", ptr);
+    }
+    return;
+  case CHUNK_BLOCKS:
+  case CHUNK_SLABS:
+    if (owns == NULL || !owns(chunk->heap)) {
+      harden_fail("free of another heap's memory", ptr);
+    }
+    break;
+  case CHUNK_LOCKFREE:
+    if (owns != NULL) {
+      harden_fail("free of another heap's memory", ptr);
+    }
+    break;
+  default:
+    harden_fail("free of memory not from ts_malloc", ptr);
+  }
+
+  char *start;
+  size_t size;
+  if (chunk->kind == CHUNK_BLOCKS) {
+    block_t *block = data_block(ptr);
+    check_header(block);
+    if (!(block_header(block) & BLOCK_ALLOC)) {
+      harden_fail("double free", ptr);
+    }
+    start = ptr;
+    size = ALIGNMENT;
+  } else if (chunk->kind == CHUNK_SLABS) {
+    slab_chunk_t *slabs = (slab_chunk_t *)chunk;
+    slab_t *slab = slab_of(chunk, ptr);
+    start = slab_start(slabs, slab - slabs->slabs);
+    size = slab->size;
+    if ((char *)ptr >= slab->bump) {
+      harden_fail("free of an invalid pointer", ptr);
+    }
+  } else {
+    size = lf_class_size(((lf_chunk_t *)chunk)->cls);
+    start = (char *)(((uintptr_t)((lf_chunk_t *)chunk + 1) +
+                      (size & -size) - 1) & ~((size & -size) - 1));
+  }
+  if ((char *)ptr < start || ((char *)ptr - start) % size != 0) {
+    harden_fail("free of an invalid pointer", ptr);
+  }
+  if (is_freed(ptr)) {
+    harden_fail("double free", ptr);
+  }
+}
+
+/* Purge every heap the caller may touch; other threads' nolock heaps
+ * purge themselves on their next allocation, and the lock-free pools
+ * keep their memory for good.  Returns 1 if memory was given back
+ * to the kernel. */
+int ts_malloc_trim(void) {
+  size_t released = 0;
+
+  for (unsigned i = 0; i < lock_arena_count; i++) {
+    lock_acquire(&lock_arenas[i].lock);
+    released += heap_purge(&lock_arenas[i].heap);
+    lock_release(&lock_arenas[i].lock);
+  }
+
+  unsigned long epoch = __atomic_add_fetch(&trim_epoch, 1, __ATOMIC_RELAXED);
+  if (nolock_heap != NULL) {
+    drain_remote_frees(nolock_heap);
+    nolock_heap->trim_epoch = epoch;
+    released += heap_purge(nolock_heap);
+  }
+
+  /* Our own cached blocks go back first, so they can be purged too */
+  lock_acquire(&tcache_mutex);
+  tcache_drain();
+  released += heap_purge(&tcache_heap);
+  lock_release(&tcache_mutex);
+
+  return released != 0;
+}
+
+/* What is wrong with a block in bin idx, or NULL */
+static const char *bin_block_problem(block_t *block, size_t idx) {
+  size_t header = block_header(block);
+  size_t size = header & BLOCK_SIZE_MASK;
+  size_t canary = harden_on() ? header_canary(block, header & HEADER_LOW) : 0;
+  if ((header & ~HEADER_LOW) != canary) {
+    return "corrupted block header";
+  }
+  if (header & BLOCK_ALLOC) {
+    return "allocated block in a free list";
+  }
+  if (size < MIN_BLOCK || size > CHUNK_FREE_BLOCK || bin_index(size) != idx) {
+    return "free block in the wrong bin";
+  }
+  if (*(size_t *)((char *)block + size - TAG_SIZE) != size) {
+    return "corrupted boundary tag";
+  }
+  size_t next = block_header(next_block(block));
+  if (!(header & BLOCK_PREV_ALLOC) || !(next & BLOCK_ALLOC)) {
+    return "free blocks not coalesced";
+  }
+  if (next & BLOCK_PREV_ALLOC) {
+    return "corrupted boundary tag";
+  }
+  return NULL;
+}
+
+/* What is wrong with a block in fast bin idx, or NULL */
+static const char *fast_block_problem(block_t *block, size_t idx) {
+  size_t header = block_header(block);
+  size_t canary = harden_on() ? header_canary(block, header & HEADER_LOW) : 0;
+  if ((header & ~HEADER_LOW) != canary ||
+      (harden_on() && (size_t)block->prev != harden_key)) {
+    return "corrupted fast bin";
+  }
+  if (!(header & BLOCK_ALLOC) || block_size(block) != idx * ALIGNMENT) {
+    return "free block in the wrong bin";
+  }
+  return NULL;
+}
+
+/* Walk a heap's free lists, counting and reporting problems if out is
+ * NULL and otherwise storing the blocks in out.  Returns how many
+ * blocks there are; a list is cut short where its links go wrong */
+static size_t free_list_walk(heap_t *heap, block_t **out, size_t *problems) {
+  size_t n = 0, fast_bytes = 0;
+  for (size_t idx = 0; idx < NUM_BINS + NUM_FAST; idx++) {
+    int fast = idx >= NUM_BINS;
+    block_t *prev = NULL;
+    block_t *block = fast ? heap->fast[idx - NUM_BINS] : heap->bins[idx];
+    for (; block != NULL; prev = block, block = block->next) {
+      const char *what = NULL;
+      if (fast) {
+        fast_bytes += block_size(block);
+        if (fast_bytes > heap->fast_bytes) {
+          what = "corrupted fast bin";
+        }
+      } else if (block->prev != prev) {
+        what = "corrupted free list";
+      }
+      if (what != NULL) {
+        if (out == NULL) {
+          harden_report(what, block_data(block));
+          (*problems)++;
+        }
+        break;
+      }
+
+      if (out != NULL) {
+        out[n++] = block;
+        continue;
+      }
+      n++;
+      what = fast ? fast_block_problem(block, idx - NUM_BINS)
+                  : bin_block_problem(block, idx);
+      if (what != NULL) {
+        harden_report(what, block_data(block));
+        (*problems)++;
+      }
+    }
+  }
+  return n;
+}
+
+/* Check a heap's free lists the way the thread tests check what they
+ * allocate: every block sound and in the right list, and no two of
+ * them overlapping.  Returns the number of problems, each reported on
+ * stderr; the caller must be allowed to read the heap. */
+static size_t heap_check(heap_t *heap) {
+  size_t problems = 0;
+  size_t n = free_list_walk(heap, NULL, &problems);
+  if (n < 2) {
+    return problems;
+  }
+
+  size_t length = PAGE_ALIGN(n * sizeof(block_t *));
+  block_t **blocks = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (blocks == MAP_FAILED) {
+    return problems;
+  }
+  free_list_walk(heap, blocks, NULL);
+  sort_ptrs((void **)blocks, n);
+  for (size_t i = 1; i < n; i++) {
+    if ((char *)blocks[i - 1] + block_size(blocks[i - 1]) >
+        (char *)blocks[i]) {
+      harden_report("free blocks overlap", block_data(blocks[i]));
+      problems++;
+    }
+  }
+  munmap(blocks, length);
+  stat_os(1, 1, 0);
+  return problems;
+}
+
+/* The heaps ts_malloc_stats() reads, under the same locks */
+int ts_malloc_check(void) {
+  size_t problems = 0;
+
+  for (unsigned i = 0; i < lock_arena_count; i++) {
+    lock_acquire(&lock_arenas[i].lock);
+    problems += heap_check(&lock_arenas[i].heap);
+    lock_release(&lock_arenas[i].lock);
+  }
+
+  lock_acquire(&tcache_mutex);
+  problems += heap_check(&tcache_heap);
+  lock_release(&tcache_mutex);
+
+  pthread_mutex_lock(&orphan_mutex);
+  for (heap_t *heap = orphan_heaps; heap != NULL; heap = heap->next_orphan) {
+    problems += heap_check(heap);
+  }
+  pthread_mutex_unlock(&orphan_mutex);
+
+  if (nolock_heap != NULL) {
+    problems += heap_check(nolock_heap);
+  }
+  return problems;
+}
+
+_Static_assert(TS_MALLOC_STATS_BINS == NUM_BINS,
+               "ts_malloc_stats_t must have a count per bin");
+
+/* Add the free lists of a heap the caller may read */
+static void stats_free_lists(heap_t *heap, ts_malloc_stats_t *stats) {
+  for (size_t idx = 0; idx < NUM_BINS; idx++) {
+    for (block_t *block = heap->bins[idx]; block != NULL;
+         block = block->next) {
+      stats->free_blocks[idx]++;
+      stats->free_bytes += block_size(block);
+    }
+  }
+  for (size_t idx = 0; idx < NUM_FAST; idx++) {
+    for (block_t *block = heap->fast[idx]; block != NULL;
+         block = block->next) {
+      stats->free_blocks[bin_index(block_size(block))]++;
+      stats->free_bytes += block_size(block);
+    }
+  }
+}
+
+/* Counters of every thread, and free lists of the heaps nobody else
+ * is using: the locked heaps, orphaned heaps and the caller's own */
+void ts_malloc_stats(ts_malloc_stats_t *stats) {
+  size_t count[STAT_COUNT];
+  memset(stats, 0, sizeof(*stats));
+
+  pthread_mutex_lock(&stats_mutex);
+  for (int i = 0; i < STAT_COUNT; i++) {
+    count[i] = stats_retired.count[i] +
+               __atomic_load_n(&stats_shared.count[i], __ATOMIC_RELAXED);
+    for (thread_stats_t *t = stats_threads; t != NULL; t = t->next) {
+      count[i] += __atomic_load_n(&t->count[i], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&stats_mutex);
+
+  stats->in_use_bytes = count[STAT_BYTES_ALLOCATED] - count[STAT_BYTES_FREED];
+  stats->mallocs = count[STAT_MALLOCS];
+  stats->frees = count[STAT_FREES];
+  stats->splits = count[STAT_SPLITS];
+  stats->coalesces = count[STAT_COALESCES];
+  stats->heap_lock_waits = count[STAT_HEAP_WAITS];
+  stats->chunk_lock_waits = count[STAT_CHUNK_WAITS];
+  for (int i = 0; i < TS_MALLOC_LOCK_BINS; i++) {
+    size_t *times = &count[STAT_LOCK_TIMES + i];
+    stats->heap_lock_wait_ns[i] = times[0];
+    stats->heap_lock_hold_ns[i] = times[TS_MALLOC_LOCK_BINS];
+    stats->chunk_lock_wait_ns[i] = times[2 * TS_MALLOC_LOCK_BINS];
+    stats->chunk_lock_hold_ns[i] = times[3 * TS_MALLOC_LOCK_BINS];
+  }
+  stats->mmap_calls = __atomic_load_n(&os_maps, __ATOMIC_RELAXED);
+  stats->munmap_calls = __atomic_load_n(&os_unmaps, __ATOMIC_RELAXED);
+  stats->mapped_bytes = __atomic_load_n(&os_mapped, __ATOMIC_RELAXED);
+
+  for (unsigned i = 0; i < lock_arena_count; i++) {
+    lock_acquire(&lock_arenas[i].lock);
+    stats_free_lists(&lock_arenas[i].heap, stats);
+    lock_release(&lock_arenas[i].lock);
+  }
+
+  lock_acquire(&tcache_mutex);
+  stats_free_lists(&tcache_heap, stats);
+  lock_release(&tcache_mutex);
+
+  pthread_mutex_lock(&orphan_mutex);
+  for (heap_t *heap = orphan_heaps; heap != NULL; heap = heap->next_orphan) {
+    stats_free_lists(heap, stats);
+  }
+  pthread_mutex_unlock(&orphan_mutex);
+
+  if (nolock_heap != NULL) {
+    stats_free_lists(nolock_heap, stats);
+  }
+}
+
+/* One line per non-empty bin, labelled with the bin's upper bound */
+static void lock_histogram_print(FILE *out, const char *name,
+                                 const size_t *bins) {
+  for (int i = 0; i < TS_MALLOC_LOCK_BINS; i++) {
+    if (bins[i] != 0) {
+      fprintf(out, "%-10s   < 2^%-2d ns %zu\n", name, i, bins[i]);
+    }
+  }
+}
+
+void ts_malloc_stats_print(FILE *out) {
+  ts_malloc_stats_t stats;
+  ts_malloc_stats(&stats);
+
+  fprintf(out, "in use       %zu bytes\n", stats.in_use_bytes);
+  fprintf(out, "free         %zu bytes\n", stats.free_bytes);
+  fprintf(out, "mapped       %zu bytes\n", stats.mapped_bytes);
+  fprintf(out, "mmap calls   %zu\n", stats.mmap_calls);
+  fprintf(out, "munmap calls %zu\n", stats.munmap_calls);
+  fprintf(out, "mallocs      %zu\n", stats.mallocs);
+  fprintf(out, "frees        %zu\n", stats.frees);
+  fprintf(out, "splits       %zu\n", stats.splits);
+  fprintf(out, "coalesces    %zu\n", stats.coalesces);
+  fprintf(out, "heap waits   %zu\n", stats.heap_lock_waits);
+  fprintf(out, "chunk waits  %zu\n", stats.chunk_lock_waits);
+  for (size_t idx = 0; idx < TS_MALLOC_STATS_BINS; idx++) {
+    if (stats.free_blocks[idx] != 0) {
+      fprintf(out, "bin %2zu       %zu free blocks\n", idx,
+              stats.free_blocks[idx]);
+    }
+  }
+  lock_histogram_print(out, "heap wait", stats.heap_lock_wait_ns);
+  lock_histogram_print(out, "heap hold", stats.heap_lock_hold_ns);
+  lock_histogram_print(out, "chunk wait", stats.chunk_lock_wait_ns);
+  lock_histogram_print(out, "chunk hold", stats.chunk_lock_hold_ns);
+}
+
+__attribute__((destructor)) static void print_stats_at_exit(void) {
+  const char *env = getenv("TS_MALLOC_STATS");
+  if (env != NULL && *env != '\0' && strcmp(env, "0") != 0) {
+    ts_malloc_stats_print(stderr);
+  }
+}
+
+/* Sampled live allocations in pprof's legacy heap format, followed by
+ * the memory map pprof needs to symbolize them */
+int ts_heap_profile_dump(FILE *out) {
+  if (prof_rate == 0) {
+    return -1;
+  }
+
+  /* stdio may allocate: keep that out of the profile and the lock */
+  prof_busy = 1;
+  pthread_mutex_lock(&prof_mutex);
+  size_t count = 0, bytes = 0;
+  for (size_t idx = 0; idx < PROF_BUCKETS; idx++) {
+    for (sample_t *sample = prof_table[idx]; sample != NULL;
+         sample = sample->next) {
+      count++;
+      bytes += sample->size;
+    }
+  }
+  fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+          count, bytes, count, bytes, prof_rate);
+  for (size_t idx = 0; idx < PROF_BUCKETS; idx++) {
+    for (sample_t *sample = prof_table[idx]; sample != NULL;
+         sample = sample->next) {
+      fprintf(out, "1: %zu [1: %zu] @", sample->size, sample->size);
+      for (int i = 0; i < sample->depth; i++) {
+        fprintf(out, " %p", sample->stack[i]);
+      }
+      fputc('\n', out);
+    }
+  }
+  pthread_mutex_unlock(&prof_mutex);
+
+  fputs("\nMAPPED_LIBRARIES:\n", out);
+  int fd = open("/proc/self/maps", O_RDONLY);
+  if (fd >= 0) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+      fwrite(buf, 1, n, out);
+    }
+    close(fd);
+  }
+  fflush(out);
+  prof_busy = 0;
+  return 0;
+}
+
+__attribute__((destructor)) static void dump_profile_at_exit(void) {
+  const char *path = getenv("TS_HEAP_PROFILE");
+  if (path == NULL || *path == '\0' || prof_rate == 0) {
+    return;
+  }
+  FILE *out = fopen(path, "w");
+  if (out != NULL) {
+    ts_heap_profile_dump(out);
+    fclose(out);
+  }
 }
@@ -9,9 +9,134 @@
 // Thread Safe malloc/free: locking version
 void *ts_malloc_lock(size_t size);
 void ts_free_lock(void *ptr);
+// Zeroed nmemb * size bytes, or NULL if that is 0 or overflows; memory
+// known to be untouched since the kernel zero-filled it is not cleared
+void *ts_calloc_lock(size_t nmemb, size_t size);
+void *ts_memalign_lock(size_t alignment, size_t size);
+void *ts_realloc_lock(void *ptr, size_t size);
+// Batches: store up to n blocks of size bytes in ptrs and return how many,
+// or free n pointers (the array is reordered)
+size_t ts_malloc_batch_lock(size_t size, void **ptrs, size_t n);
+void ts_free_batch_lock(void **ptrs, size_t n);
 
 // Thread Safe malloc/free: non-locking version
 void *ts_malloc_nolock(size_t size);
 void ts_free_nolock(void *ptr);
+void *ts_calloc_nolock(size_t nmemb, size_t size);
+void *ts_memalign_nolock(size_t alignment, size_t size);
+void *ts_realloc_nolock(void *ptr, size_t size);
+size_t ts_malloc_batch_nolock(size_t size, void **ptrs, size_t n);
+void ts_free_batch_nolock(void **ptrs, size_t n);
+
+// Thread Safe malloc/free: per-thread cache over a locked shared heap
+void *ts_malloc_tcache(size_t size);
+void ts_free_tcache(void *ptr);
+// Free with the size asked of malloc, calloc or realloc: its class
+// routes and counts the free without reading the block's header.
+// Checked against the header when built with -DMALLOC_DEBUG or
+// hardened.  The lock and nolock versions have none, as their slab
+// objects and blocks need their metadata to be freed anyway
+void ts_free_sized_tcache(void *ptr, size_t size);
+void *ts_calloc_tcache(size_t nmemb, size_t size);
+void *ts_memalign_tcache(size_t alignment, size_t size);
+void *ts_realloc_tcache(void *ptr, size_t size);
+size_t ts_malloc_batch_tcache(size_t size, void **ptrs, size_t n);
+void ts_free_batch_tcache(void **ptrs, size_t n);
+
+// Thread Safe malloc/free: lock-free size-class pools
+void *ts_malloc_lockfree(size_t size);
+void ts_free_lockfree(void *ptr);
+// As ts_free_sized_tcache; the object's chunk is not read either
+void ts_free_sized_lockfree(void *ptr, size_t size);
+void *ts_calloc_lockfree(size_t nmemb, size_t size);
+void *ts_memalign_lockfree(size_t alignment, size_t size);
+void *ts_realloc_lockfree(void *ptr, size_t size);
+size_t ts_malloc_batch_lockfree(size_t size, void **ptrs, size_t n);
+void ts_free_batch_lockfree(void **ptrs, size_t n);
+
+// Thread Safe malloc/free: whichever version is configured, picked by
+// ts_malloc_set_engine() (before the first call; 0 on success) or else
+// by TS_MALLOC_ENGINE=lock|nolock|tcache|lockfree (nolock by default)
+int ts_malloc_set_engine(const char *name);
+const char *ts_malloc_engine(void);
+void *ts_malloc(size_t size);
+void ts_free(void *ptr);
+// The lock and nolock versions only check the size
+void ts_free_sized(void *ptr, size_t size);
+void *ts_calloc(size_t nmemb, size_t size);
+void *ts_memalign(size_t alignment, size_t size);
+// Any power-of-two alignment, up to 2 MiB and beyond; aligned_alloc
+// returns NULL and posix_memalign EINVAL for a bad one, and
+// posix_memalign ENOMEM if there is no memory; for 0 bytes
+// posix_memalign stores NULL and succeeds
+void *ts_aligned_alloc(size_t alignment, size_t size);
+int ts_posix_memalign(void **memptr, size_t alignment, size_t size);
+void *ts_realloc(void *ptr, size_t size);
+size_t ts_malloc_batch(size_t size, void **ptrs, size_t n);
+void ts_free_batch(void **ptrs, size_t n);
+
+// Usable bytes at ptr, for memory from any of the versions above
+size_t ts_malloc_usable_size(void *ptr);
+
+// Give free heap memory back to the OS; 1 if any was released
+int ts_malloc_trim(void);
+
+// Check the free lists of the heaps ts_malloc_stats() reads: links,
+// boundary tags, bins, and no two free blocks overlapping.  Returns
+// the number of problems, each reported on stderr.
+//
+// Hardened mode (TS_HARDENED=1, or built with -DHARDENED=1): block
+// headers carry a keyed checksum, and a corrupted header or free list,
+// a double free, or a free of memory that is not from this version's
+// heaps prints what was found and aborts.  Every purge checks links,
+// tags and bins as above, aborting on any problem.
+int ts_malloc_check(void);
+
+// Statistics, summed over all threads when asked for.  Counts cover
+// every version except regions; the free lists are those of the heaps
+// the caller may inspect (all but other threads' nolock heaps).
+// TS_MALLOC_STATS=1 prints them to stderr at exit.
+//
+// The heap and chunk locks are pthread mutexes, or with
+// TS_LOCK=spin|ticket|mcs spin-then-park, ticket or MCS queue locks.
+// TS_LOCK_PROFILE=1 fills the lock histograms: bin i counts the
+// acquisitions that waited for, or held, the lock under 2^i ns
+// (and, for i > 0, at least 2^(i-1) ns); the last bin takes the rest.
+#define TS_MALLOC_STATS_BINS 64
+#define TS_MALLOC_LOCK_BINS 32
+typedef struct ts_malloc_stats {
+  size_t in_use_bytes;       // usable bytes of live allocations
+  size_t free_bytes;         // bytes in the free lists below
+  size_t free_blocks[TS_MALLOC_STATS_BINS];  // free list length per bin
+  size_t mapped_bytes;       // bytes currently mapped from the OS
+  size_t mmap_calls;         // mmap and mremap calls
+  size_t munmap_calls;
+  size_t mallocs;            // allocations, batches counted per block
+  size_t frees;
+  size_t splits;             // free blocks split on allocation
+  size_t coalesces;          // free blocks merged with a neighbour
+  size_t heap_lock_waits;    // heap mutex acquisitions that had to wait
+  size_t chunk_lock_waits;   // same for the mutex guarding chunk refills
+  size_t heap_lock_wait_ns[TS_MALLOC_LOCK_BINS];
+  size_t heap_lock_hold_ns[TS_MALLOC_LOCK_BINS];
+  size_t chunk_lock_wait_ns[TS_MALLOC_LOCK_BINS];
+  size_t chunk_lock_hold_ns[TS_MALLOC_LOCK_BINS];
+} ts_malloc_stats_t;
+void ts_malloc_stats(ts_malloc_stats_t *stats);
+void ts_malloc_stats_print(FILE *out);
+
+// Heap profile: with TS_HEAP_PROFILE_RATE=<bytes> set, about one
+// allocation per that many bytes records its call stack.  Writes the
+// sampled allocations still live in pprof's legacy heap format;
+// -1 if profiling is off.  TS_HEAP_PROFILE=<file> dumps at exit.
+int ts_heap_profile_dump(FILE *out);
+
+// Regions: bump allocation, all memory released at once by reset or
+// destroy; a region must not be used by two threads at the same time
+typedef struct ts_arena ts_arena_t;
+ts_arena_t *ts_arena_create(void);
+void *ts_arena_alloc(ts_arena_t *arena, size_t size);
+void ts_arena_reset(ts_arena_t *arena);
+void ts_arena_destroy(ts_arena_t *arena);
 
 #endif
@@ -12,6 +12,18 @@
 #define MALLOC(sz) ts_malloc_nolock(sz)
 #define FREE(p)    ts_free_nolock(p)
 #endif
+#ifdef TCACHE_VERSION
+#define MALLOC(sz) ts_malloc_tcache(sz)
+#define FREE(p)    ts_free_tcache(p)
+#endif
+#ifdef LOCKFREE_VERSION
+#define MALLOC(sz) ts_malloc_lockfree(sz)
+#define FREE(p)    ts_free_lockfree(p)
+#endif
+#ifdef RUNTIME_VERSION
+#define MALLOC(sz) ts_malloc(sz)
+#define FREE(p)    ts_free(p)
+#endif
 
 #define NUM_THREADS  4
 #define NUM_ITEMS    10000
@@ -100,8 +112,8 @@ int main(int argc, char *argv[])
       if (i == j) continue;
       tgt_start = malloc_items[j].address;
       tgt_end   = tgt_start + (malloc_items[j].bytes / sizeof(int));
-      if (((start >= tgt_start) && (start <= tgt_end)) ||
-	  ((end >= tgt_start) && (end <= tgt_end))) {
+      //Regions are half-open [start, end): touching is not overlapping
+      if ((start < tgt_end) && (tgt_start < end)) {
 	fail = 1;
 	break;
       } //if
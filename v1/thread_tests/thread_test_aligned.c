@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "my_malloc.h"
+
+#ifdef LOCK_VERSION
+#define MALLOC(sz)     ts_malloc_lock(sz)
+#define FREE(p)        ts_free_lock(p)
+#define ALIGNED(a, sz) ts_memalign_lock(a, sz)
+#endif
+#ifdef NOLOCK_VERSION
+#define MALLOC(sz)     ts_malloc_nolock(sz)
+#define FREE(p)        ts_free_nolock(p)
+#define ALIGNED(a, sz) ts_memalign_nolock(a, sz)
+#endif
+#ifdef TCACHE_VERSION
+#define MALLOC(sz)     ts_malloc_tcache(sz)
+#define FREE(p)        ts_free_tcache(p)
+#define ALIGNED(a, sz) ts_memalign_tcache(a, sz)
+#endif
+#ifdef LOCKFREE_VERSION
+#define MALLOC(sz)     ts_malloc_lockfree(sz)
+#define FREE(p)        ts_free_lockfree(p)
+#define ALIGNED(a, sz) ts_memalign_lockfree(a, sz)
+#endif
+#ifdef RUNTIME_VERSION
+#define MALLOC(sz)     ts_malloc(sz)
+#define FREE(p)        ts_free(p)
+#define ALIGNED(a, sz) ts_aligned_alloc(a, sz)
+#endif
+
+#define NUM_THREADS  4
+#define NUM_ITEMS    1000
+
+pthread_t threads[NUM_THREADS];
+int       thread_id[NUM_THREADS];
+
+pthread_barrier_t barrier;
+
+struct malloc_list {
+  size_t bytes;
+  size_t alignment;
+  int *address;
+  int free;
+};
+typedef struct malloc_list malloc_list_t;
+
+malloc_list_t malloc_items[NUM_THREADS * NUM_ITEMS];
+int misaligned[NUM_THREADS];
+
+void do_allocate(int thread_id) {
+  int i, index;
+  int thread_start_index = thread_id * NUM_ITEMS;
+
+  //Let all threads get up and running
+  //Want the concurrent malloc calls to be as high as possible
+  pthread_barrier_wait(&barrier); 
+
+  //Interleave plain and aligned blocks, so aligned ones have to be
+  //found inside the holes the plain ones leave behind
+  for (i=0; i < NUM_ITEMS; i++) {
+    index = i + thread_start_index;
+    if (malloc_items[index].alignment == 0) {
+      malloc_items[index].address = (int *)MALLOC(malloc_items[index].bytes);
+    } else {
+      malloc_items[index].address =
+          (int *)ALIGNED(malloc_items[index].alignment, malloc_items[index].bytes);
+      if (malloc_items[index].address == NULL ||
+          (uintptr_t)malloc_items[index].address % malloc_items[index].alignment != 0) {
+        misaligned[thread_id]++;
+      }
+    }
+    malloc_items[index].free = 0;
+    if (malloc_items[index].address != NULL) {
+      malloc_items[index].address[0] = index;
+      malloc_items[index].address[malloc_items[index].bytes / sizeof(int) - 1] = index;
+    }
+    if ((i % 4) == 1) {
+      FREE(malloc_items[index - 1].address);
+      malloc_items[index - 1].free = 1;
+    }
+  } //for i
+
+  pthread_barrier_wait(&barrier);
+}
+
+void *allocate(void *arg) {
+  int id = *((int *) arg);
+  do_allocate(id);
+  return NULL;
+} 
+
+int main(int argc, char *argv[])
+{
+  int i, j;
+
+  srand(0);
+
+  //Cache line, page and huge page alignments between plain blocks
+  const size_t alignments[] = { 0, 64, 0, 4096, 0, 256, 0, 2UL << 20 };
+  const unsigned chunk_size = 32;
+  const unsigned min_chunks = 1;
+  const unsigned max_chunks = 64;
+  for (i=0; i < NUM_THREADS*NUM_ITEMS; i++) {
+    unsigned num_chunks = (rand() % (max_chunks - min_chunks + 1)) + min_chunks;
+    malloc_items[i].bytes = num_chunks * chunk_size;
+    malloc_items[i].alignment = alignments[i % 8];
+  } //for i
+
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  for (i=0; i < NUM_THREADS; i++) {
+    thread_id[i] = i;
+    pthread_create(&threads[i], NULL, allocate, (void *)(&thread_id[i]));
+  } //for i
+
+  for (i=0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  } //for i
+
+  //Check for correctness!
+
+  int *start, *end, *tgt_start, *tgt_end;
+  int fail = 0;
+  for (i=0; i < NUM_THREADS; i++) {
+    if (misaligned[i] != 0) {
+      printf("Thread %d got %d items that were missing or misaligned\n", i, misaligned[i]);
+      fail = 2;
+    } //if
+  } //for i
+
+  //Zero bytes are no error: the pointer may be NULL or one to free
+  void *zero = &zero;
+  if (ts_posix_memalign(&zero, 64, 0) != 0) {
+    printf("posix_memalign failed for 0 bytes\n");
+    fail = 2;
+  } else {
+    ts_free(zero);
+  } //else
+
+  for (i=0; fail == 0 && i < NUM_THREADS * NUM_ITEMS; i++) {
+    if (malloc_items[i].free == 1) continue;
+    start = malloc_items[i].address;
+    end   = start + (malloc_items[i].bytes / sizeof(int));
+    if (start[0] != i || end[-1] != i) {
+      printf("Item %d was overwritten\n", i);
+      fail = 2;
+      break;
+    }
+
+    for (j=0; j < NUM_THREADS * NUM_ITEMS; j++) {
+      if (malloc_items[j].free == 1) continue;
+      if (i == j) continue;
+      tgt_start = malloc_items[j].address;
+      tgt_end   = tgt_start + (malloc_items[j].bytes / sizeof(int));
+      //Regions are half-open [start, end): touching is not overlapping
+      if ((start < tgt_end) && (tgt_start < end)) {
+	fail = 1;
+	break;
+      } //if
+    }
+
+    if (fail == 1) break;
+  } //for i
+
+  if (fail == 0) {
+    printf("No overlapping allocated regions found!\n");
+    printf("Test passed\n");
+  } else if (fail == 1) {
+    printf("Found 2 overlapping allocated regions.\n");
+    printf("Region 1 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", start, end, malloc_items[i].bytes, i);
+    printf("Region 2 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", tgt_start, tgt_end, malloc_items[j].bytes, j);
+    printf("Test failed\n");
+  } else {
+    printf("Test failed\n");
+  } //else
+
+  for (i=0; i < NUM_THREADS * NUM_ITEMS; i++) {
+    if (malloc_items[i].free == 0) {
+      FREE(malloc_items[i].address);
+    } //if
+  } //for i
+
+  return 0;
+}
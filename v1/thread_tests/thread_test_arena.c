@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "my_malloc.h"
+
+//Regions are shared by all versions; MALLOC_VERSION is not used here
+
+#define NUM_THREADS  4
+#define NUM_ITEMS    5000
+#define NUM_ROUNDS   20
+
+pthread_t threads[NUM_THREADS];
+int       thread_id[NUM_THREADS];
+
+pthread_barrier_t barrier;
+
+struct malloc_list {
+  size_t bytes;
+  int *address;
+};
+typedef struct malloc_list malloc_list_t;
+
+malloc_list_t malloc_items[NUM_THREADS * NUM_ITEMS];
+int corrupted[NUM_THREADS];
+
+//Every int of an item holds its index and round, so overlaps show
+void fill(int index, int round) {
+  size_t k;
+  for (k = 0; k < malloc_items[index].bytes / sizeof(int); k++) {
+    malloc_items[index].address[k] = index * NUM_ROUNDS + round;
+  }
+}
+
+int check(int index, int round) {
+  size_t k;
+  for (k = 0; k < malloc_items[index].bytes / sizeof(int); k++) {
+    if (malloc_items[index].address[k] != index * NUM_ROUNDS + round) return 0;
+  }
+  return 1;
+}
+
+void do_allocate(int thread_id) {
+  int i, r, index;
+  int thread_start_index = thread_id * NUM_ITEMS;
+  ts_arena_t *arena = ts_arena_create();
+
+  //Let all threads get up and running
+  //Want the concurrent malloc calls to be as high as possible
+  pthread_barrier_wait(&barrier);
+
+  //Each round fills the region, checks it and empties it again
+  for (r=0; r < NUM_ROUNDS; r++) {
+    for (i=0; i < NUM_ITEMS; i++) {
+      index = i + thread_start_index;
+      malloc_items[index].address = (int *)ts_arena_alloc(arena, malloc_items[index].bytes);
+      if (malloc_items[index].address == NULL || ((size_t)malloc_items[index].address & 15) != 0) {
+	corrupted[thread_id]++;
+	ts_arena_destroy(arena);
+	return;
+      }
+      fill(index, r);
+    } //for i
+
+    for (i=0; i < NUM_ITEMS; i++) {
+      index = i + thread_start_index;
+      if (!check(index, r)) corrupted[thread_id]++;
+    } //for i
+
+    if (r < NUM_ROUNDS - 1) {
+      ts_arena_reset(arena);
+    }
+  } //for r
+
+  pthread_barrier_wait(&barrier);
+  ts_arena_destroy(arena);
+}
+
+
+void *allocate(void *arg) {
+  int id = *((int *) arg);
+  do_allocate(id);
+  return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+  int i;
+
+  srand(0);
+
+  //Mostly small temporaries, with the occasional mapping of its own
+  const unsigned chunk_size = 32;
+  const unsigned min_chunks = 1;
+  const unsigned max_chunks = 64;
+  for (i=0; i < NUM_THREADS*NUM_ITEMS; i++) {
+    unsigned num_chunks = (rand() % (max_chunks - min_chunks + 1)) + min_chunks;
+    malloc_items[i].bytes = num_chunks * chunk_size;
+    if ((i % 1000) == 999) {
+      malloc_items[i].bytes = 300 * 1024;
+    }
+  } //for i
+
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  for (i=0; i < NUM_THREADS; i++) {
+    thread_id[i] = i;
+    pthread_create(&threads[i], NULL, allocate, (void *)(&thread_id[i]));
+  } //for i
+
+  for (i=0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  } //for i
+
+  //Check for correctness!
+
+  int fail = 0;
+  for (i=0; i < NUM_THREADS; i++) {
+    if (corrupted[i] != 0) {
+      printf("Thread %d saw %d region items that were lost or overwritten\n", i, corrupted[i]);
+      fail = 1;
+    } //if
+  } //for i
+
+  if (fail == 0) {
+    printf("No overlapping allocated regions found!\n");
+    printf("Test passed\n");
+  } else {
+    printf("Test failed\n");
+  } //else
+
+  return 0;
+}
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "my_malloc.h"
+
+#ifdef LOCK_VERSION
+#define MALLOC_BATCH(sz, p, n) ts_malloc_batch_lock(sz, p, n)
+#define FREE_BATCH(p, n)       ts_free_batch_lock(p, n)
+#endif
+#ifdef NOLOCK_VERSION
+#define MALLOC_BATCH(sz, p, n) ts_malloc_batch_nolock(sz, p, n)
+#define FREE_BATCH(p, n)       ts_free_batch_nolock(p, n)
+#endif
+#ifdef TCACHE_VERSION
+#define MALLOC_BATCH(sz, p, n) ts_malloc_batch_tcache(sz, p, n)
+#define FREE_BATCH(p, n)       ts_free_batch_tcache(p, n)
+#endif
+#ifdef LOCKFREE_VERSION
+#define MALLOC_BATCH(sz, p, n) ts_malloc_batch_lockfree(sz, p, n)
+#define FREE_BATCH(p, n)       ts_free_batch_lockfree(p, n)
+#endif
+#ifdef RUNTIME_VERSION
+#define MALLOC_BATCH(sz, p, n) ts_malloc_batch(sz, p, n)
+#define FREE_BATCH(p, n)       ts_free_batch(p, n)
+#endif
+
+#define NUM_THREADS  4
+#define NUM_BATCHES  100
+#define BATCH_SIZE   50
+#define NUM_ITEMS    (NUM_BATCHES * BATCH_SIZE)
+
+pthread_t threads[NUM_THREADS];
+int       thread_id[NUM_THREADS];
+
+pthread_barrier_t barrier;
+
+struct batch {
+  size_t bytes;
+  void *address[BATCH_SIZE];
+  int free;
+};
+typedef struct batch batch_t;
+
+batch_t batches[NUM_THREADS * NUM_BATCHES];
+int corrupted[NUM_THREADS];
+
+//Every int of an item holds its item number, so overlaps show as damage
+void fill(int index, int k) {
+  size_t w;
+  int *item = batches[index].address[k];
+  for (w = 0; w < batches[index].bytes / sizeof(int); w++) {
+    item[w] = index * BATCH_SIZE + k;
+  }
+}
+
+int check(int index, int k) {
+  size_t w;
+  int *item = batches[index].address[k];
+  for (w = 0; w < batches[index].bytes / sizeof(int); w++) {
+    if (item[w] != index * BATCH_SIZE + k) return 0;
+  }
+  return 1;
+}
+
+void do_allocate(int thread_id) {
+  int i, k, index;
+  int thread_start_index = thread_id * NUM_BATCHES;
+  //Free batches that were malloc'ed by the next thread
+  int other_start_index = ((thread_id + 1) % NUM_THREADS) * NUM_BATCHES;
+
+  //Let all threads get up and running
+  //Want the concurrent malloc calls to be as high as possible
+  pthread_barrier_wait(&barrier);
+
+  for (i=0; i < NUM_BATCHES; i++) {
+    index = i + thread_start_index;
+    if (MALLOC_BATCH(batches[index].bytes, batches[index].address, BATCH_SIZE) != BATCH_SIZE) {
+      corrupted[thread_id]++;
+      continue;
+    }
+    batches[index].free = 0;
+    for (k=0; k < BATCH_SIZE; k++) {
+      fill(index, k);
+    }
+  } //for i
+
+  pthread_barrier_wait(&barrier);
+
+  for (i=0; i < NUM_BATCHES; i += 2) {
+    index = i + other_start_index;
+    for (k=0; k < BATCH_SIZE; k++) {
+      if (!check(index, k)) corrupted[thread_id]++;
+    }
+    FREE_BATCH(batches[index].address, BATCH_SIZE);
+    batches[index].free = 1;
+  } //for i
+
+  pthread_barrier_wait(&barrier);
+
+  //Reuse what the other threads gave back
+  for (i=0; i < NUM_BATCHES; i += 2) {
+    index = i + thread_start_index;
+    if (MALLOC_BATCH(batches[index].bytes, batches[index].address, BATCH_SIZE) != BATCH_SIZE) {
+      corrupted[thread_id]++;
+      continue;
+    }
+    batches[index].free = 0;
+    for (k=0; k < BATCH_SIZE; k++) {
+      fill(index, k);
+    }
+  } //for i
+
+  pthread_barrier_wait(&barrier);
+}
+
+
+void *allocate(void *arg) {
+  int id = *((int *) arg);
+  do_allocate(id);
+  return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+  int i, k;
+
+  srand(0);
+
+  //Every batch is of one size, from small objects to large blocks
+  const unsigned chunk_size = 32;
+  const unsigned min_chunks = 1;
+  const unsigned max_chunks = 64;
+  for (i=0; i < NUM_THREADS*NUM_BATCHES; i++) {
+    unsigned num_chunks = (rand() % (max_chunks - min_chunks + 1)) + min_chunks;
+    batches[i].bytes = num_chunks * chunk_size;
+    batches[i].free = 1;
+  } //for i
+
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  for (i=0; i < NUM_THREADS; i++) {
+    thread_id[i] = i;
+    pthread_create(&threads[i], NULL, allocate, (void *)(&thread_id[i]));
+  } //for i
+
+  for (i=0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  } //for i
+
+  //Check for correctness!
+
+  int fail = 0;
+  for (i=0; i < NUM_THREADS; i++) {
+    if (corrupted[i] != 0) {
+      printf("Thread %d saw %d items that were lost or overwritten\n", i, corrupted[i]);
+      fail = 1;
+    } //if
+  } //for i
+
+  for (i=0; fail == 0 && i < NUM_THREADS * NUM_BATCHES; i++) {
+    if (batches[i].free == 1) continue;
+    for (k=0; k < BATCH_SIZE; k++) {
+      if (!check(i, k)) {
+	printf("Item %d of batch %d was overwritten\n", k, i);
+	fail = 1;
+	break;
+      } //if
+    } //for k
+  } //for i
+
+  if (fail == 0) {
+    printf("No overlapping allocated regions found!\n");
+    printf("Test passed\n");
+  } else {
+    printf("Test failed\n");
+  } //else
+
+  for (i=0; i < NUM_THREADS * NUM_BATCHES; i++) {
+    if (batches[i].free == 0) {
+      FREE_BATCH(batches[i].address, BATCH_SIZE);
+    } //if
+  } //for i
+
+  return 0;
+}
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "my_malloc.h"
+
+#ifdef LOCK_VERSION
+#define MALLOC(sz)     ts_malloc_lock(sz)
+#define FREE(p)        ts_free_lock(p)
+#define CALLOC(n, sz)  ts_calloc_lock(n, sz)
+#endif
+#ifdef NOLOCK_VERSION
+#define MALLOC(sz)     ts_malloc_nolock(sz)
+#define FREE(p)        ts_free_nolock(p)
+#define CALLOC(n, sz)  ts_calloc_nolock(n, sz)
+#endif
+#ifdef TCACHE_VERSION
+#define MALLOC(sz)     ts_malloc_tcache(sz)
+#define FREE(p)        ts_free_tcache(p)
+#define CALLOC(n, sz)  ts_calloc_tcache(n, sz)
+#endif
+#ifdef LOCKFREE_VERSION
+#define MALLOC(sz)     ts_malloc_lockfree(sz)
+#define FREE(p)        ts_free_lockfree(p)
+#define CALLOC(n, sz)  ts_calloc_lockfree(n, sz)
+#endif
+#ifdef RUNTIME_VERSION
+#define MALLOC(sz)     ts_malloc(sz)
+#define FREE(p)        ts_free(p)
+#define CALLOC(n, sz)  ts_calloc(n, sz)
+#endif
+
+
+#define NUM_THREADS  4
+#define NUM_ITEMS    2000
+#define NUM_ROUNDS   4
+
+pthread_t threads[NUM_THREADS];
+int       thread_id[NUM_THREADS];
+
+pthread_barrier_t barrier;
+
+struct malloc_list {
+  size_t bytes;
+  int *address;
+};
+typedef struct malloc_list malloc_list_t;
+
+malloc_list_t malloc_items[NUM_THREADS * NUM_ITEMS];
+int dirty[NUM_THREADS];
+
+//Every int of an item holds its index, so a later calloc that hands
+//out the same memory without clearing it shows
+void fill(int index) {
+  size_t k;
+  for (k = 0; k < malloc_items[index].bytes / sizeof(int); k++) {
+    malloc_items[index].address[k] = index + 1;
+  }
+}
+
+int zeroed(int index) {
+  const unsigned char *p = (const unsigned char *)malloc_items[index].address;
+  size_t k;
+  for (k = 0; k < malloc_items[index].bytes; k++) {
+    if (p[k] != 0) return 0;
+  }
+  return 1;
+}
+
+void do_allocate(int thread_id) {
+  int i, r, index;
+  int thread_start_index = thread_id * NUM_ITEMS;
+
+  //Let all threads get up and running
+  //Want the concurrent malloc calls to be as high as possible
+  pthread_barrier_wait(&barrier); 
+
+  //Dirty some memory first, so calloc has recycled blocks to clear
+  for (i=0; i < NUM_ITEMS; i++) {
+    index = i + thread_start_index;
+    malloc_items[index].address = (int *)MALLOC(malloc_items[index].bytes);
+    fill(index);
+  } //for i
+
+  //Free every other item and calloc it back, round after round
+  for (r=0; r < NUM_ROUNDS; r++) {
+    for (i=r % 2; i < NUM_ITEMS; i += 2) {
+      index = i + thread_start_index;
+      FREE(malloc_items[index].address);
+    } //for i
+    for (i=r % 2; i < NUM_ITEMS; i += 2) {
+      index = i + thread_start_index;
+      malloc_items[index].address =
+          (int *)CALLOC(malloc_items[index].bytes / sizeof(int), sizeof(int));
+      if (!zeroed(index)) {
+        dirty[thread_id]++;
+      }
+      fill(index);
+    } //for i
+  } //for r
+
+  pthread_barrier_wait(&barrier);
+}
+
+
+void *allocate(void *arg) {
+  int id = *((int *) arg);
+  do_allocate(id);
+  return NULL;
+} 
+
+
+int main(int argc, char *argv[])
+{
+  int i, j;
+
+  srand(0);
+
+  //Slab, block and (every 100th item) mmap sizes
+  const unsigned chunk_size = 32;
+  const unsigned min_chunks = 1;
+  const unsigned max_chunks = 64;
+  for (i=0; i < NUM_THREADS*NUM_ITEMS; i++) {
+    unsigned num_chunks = (rand() % (max_chunks - min_chunks + 1)) + min_chunks;
+    malloc_items[i].bytes = num_chunks * chunk_size;
+    if ((i % 100) == 7) {
+      malloc_items[i].bytes *= 256;
+    }
+  } //for i
+
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  for (i=0; i < NUM_THREADS; i++) {
+    thread_id[i] = i;
+    pthread_create(&threads[i], NULL, allocate, (void *)(&thread_id[i]));
+  } //for i
+
+  for (i=0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  } //for i
+
+  //Check for correctness!
+
+  int *start, *end, *tgt_start, *tgt_end;
+  int fail = 0;
+  for (i=0; i < NUM_THREADS; i++) {
+    if (dirty[i] != 0) {
+      printf("Thread %d got %d calloc'ed items that were not zeroed\n", i, dirty[i]);
+      fail = 2;
+    } //if
+  } //for i
+
+  for (i=0; fail == 0 && i < NUM_THREADS * NUM_ITEMS; i++) {
+    start = malloc_items[i].address;
+    end   = start + (malloc_items[i].bytes / sizeof(int));
+
+    for (j=0; j < NUM_THREADS * NUM_ITEMS; j++) {
+      if (i == j) continue;
+      tgt_start = malloc_items[j].address;
+      tgt_end   = tgt_start + (malloc_items[j].bytes / sizeof(int));
+      //Regions are half-open [start, end): touching is not overlapping
+      if ((start < tgt_end) && (tgt_start < end)) {
+	fail = 1;
+	break;
+      } //if
+    }
+
+    if (fail == 1) break;
+  } //for i
+
+  if (fail == 0) {
+    printf("No overlapping allocated regions found!\n");
+    printf("Test passed\n");
+  } else if (fail == 1) {
+    printf("Found 2 overlapping allocated regions.\n");
+    printf("Region 1 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", start, end, malloc_items[i].bytes, i);
+    printf("Region 2 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", tgt_start, tgt_end, malloc_items[j].bytes, j);
+    printf("Test failed\n");
+  } else {
+    printf("Test failed\n");
+  } //else
+
+  for (i=0; i < NUM_THREADS * NUM_ITEMS; i++) {
+    FREE(malloc_items[i].address);
+  } //for i
+
+  return 0;
+}
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "my_malloc.h"
+
+#ifdef LOCK_VERSION
+#define MALLOC(sz) ts_malloc_lock(sz)
+#define FREE(p)    ts_free_lock(p)
+#endif
+#ifdef NOLOCK_VERSION
+#define MALLOC(sz) ts_malloc_nolock(sz)
+#define FREE(p)    ts_free_nolock(p)
+#endif
+#ifdef TCACHE_VERSION
+#define MALLOC(sz) ts_malloc_tcache(sz)
+#define FREE(p)    ts_free_tcache(p)
+#endif
+#ifdef LOCKFREE_VERSION
+#define MALLOC(sz) ts_malloc_lockfree(sz)
+#define FREE(p)    ts_free_lockfree(p)
+#endif
+#ifdef RUNTIME_VERSION
+#define MALLOC(sz) ts_malloc(sz)
+#define FREE(p)    ts_free(p)
+#endif
+
+
+#define NUM_THREADS  4
+#define NUM_ITEMS    64
+#define NUM_FORKS    200
+#define CHILD_ITEMS  256
+#define CHILD_SECS   10
+
+pthread_t threads[NUM_THREADS];
+int       thread_id[NUM_THREADS];
+
+pthread_barrier_t barrier;
+volatile int done = 0;
+
+//Slab, block and (every 16th item) mmap sizes
+size_t item_bytes(int i) {
+  size_t bytes = (size_t)((i * 37) % 64 + 1) * 32;
+  if ((i % 16) == 7) {
+    bytes *= 256;
+  }
+  return bytes;
+}
+
+//Keep every allocator lock busy until main() is done forking
+void do_allocate(int thread_id) {
+  char *items[NUM_ITEMS];
+  int i;
+
+  pthread_barrier_wait(&barrier);
+
+  while (!done) {
+    for (i=0; i < NUM_ITEMS; i++) {
+      items[i] = (char *)MALLOC(item_bytes(i + thread_id));
+      items[i][0] = (char)i;
+    } //for i
+    for (i=0; i < NUM_ITEMS; i++) {
+      FREE(items[i]);
+    } //for i
+  } //while
+}
+
+
+void *allocate(void *arg) {
+  int id = *((int *) arg);
+  do_allocate(id);
+  return NULL;
+} 
+
+
+//In the child only this thread is left: every size it asks for has
+//to come back without waiting on a lock a vanished thread held
+void child(void) {
+  char *items[CHILD_ITEMS];
+  int i;
+
+  alarm(CHILD_SECS);   //a deadlock dies with SIGALRM instead of hanging
+  for (i=0; i < CHILD_ITEMS; i++) {
+    items[i] = (char *)MALLOC(item_bytes(i));
+    if (items[i] == NULL) {
+      _exit(1);
+    }
+    memset(items[i], i, item_bytes(i));
+  } //for i
+  for (i=0; i < CHILD_ITEMS; i++) {
+    if (items[i][item_bytes(i) - 1] != (char)i) {
+      _exit(2);
+    }
+    FREE(items[i]);
+  } //for i
+  _exit(0);
+}
+
+
+int main(int argc, char *argv[])
+{
+  int i, status;
+  int fail = 0;
+  pid_t pid;
+
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS + 1);
+  for (i=0; i < NUM_THREADS; i++) {
+    thread_id[i] = i;
+    pthread_create(&threads[i], NULL, allocate, (void *)(&thread_id[i]));
+  } //for i
+
+  pthread_barrier_wait(&barrier);
+  for (i=0; fail == 0 && i < NUM_FORKS; i++) {
+    pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      fail = 1;
+      break;
+    }
+    if (pid == 0) {
+      child();
+    }
+    if (waitpid(pid, &status, 0) != pid) {
+      perror("waitpid");
+      fail = 1;
+    } else if (WIFSIGNALED(status)) {
+      printf("Child %d died with signal %d\n", i, WTERMSIG(status));
+      fail = 1;
+    } else if (WEXITSTATUS(status) != 0) {
+      printf("Child %d exited with status %d\n", i, WEXITSTATUS(status));
+      fail = 1;
+    } //else if
+  } //for i
+
+  done = 1;
+  for (i=0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  } //for i
+
+  if (fail == 0) {
+    printf("All %d children allocated after fork()\n", NUM_FORKS);
+    printf("Test passed\n");
+  } else {
+    printf("Test failed\n");
+  } //else
+
+  return 0;
+}
@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "my_malloc.h"
+
+#ifdef LOCK_VERSION
+#define MALLOC(sz) ts_malloc_lock(sz)
+#define FREE(p)    ts_free_lock(p)
+#define FREE_SIZED(p, sz) ts_free_lock(p)       //no sized free
+#define REALLOC(p, sz) ts_realloc_lock(p, sz)
+#endif
+#ifdef NOLOCK_VERSION
+#define MALLOC(sz) ts_malloc_nolock(sz)
+#define FREE(p)    ts_free_nolock(p)
+#define FREE_SIZED(p, sz) ts_free_nolock(p)     //no sized free
+#define REALLOC(p, sz) ts_realloc_nolock(p, sz)
+#endif
+#ifdef TCACHE_VERSION
+#define MALLOC(sz) ts_malloc_tcache(sz)
+#define FREE(p)    ts_free_tcache(p)
+#define FREE_SIZED(p, sz) ts_free_sized_tcache(p, sz)
+#define REALLOC(p, sz) ts_realloc_tcache(p, sz)
+#endif
+#ifdef LOCKFREE_VERSION
+#define MALLOC(sz) ts_malloc_lockfree(sz)
+#define FREE(p)    ts_free_lockfree(p)
+#define FREE_SIZED(p, sz) ts_free_sized_lockfree(p, sz)
+#define REALLOC(p, sz) ts_realloc_lockfree(p, sz)
+#endif
+#ifdef RUNTIME_VERSION
+#define MALLOC(sz) ts_malloc(sz)
+#define FREE(p)    ts_free(p)
+#define FREE_SIZED(p, sz) ts_free_sized(p, sz)
+#define REALLOC(p, sz) ts_realloc(p, sz)
+#endif
+
+#define NUM_THREADS  4
+#define NUM_ITEMS    5000
+
+pthread_t threads[NUM_THREADS];
+int       thread_id[NUM_THREADS];
+
+pthread_barrier_t barrier;
+
+struct malloc_list {
+  size_t bytes;
+  int *address;
+  int free;
+};
+typedef struct malloc_list malloc_list_t;
+
+malloc_list_t malloc_items[NUM_THREADS * NUM_ITEMS];
+
+
+void do_allocate(int thread_id) {
+  int i, index;
+  int counter = thread_id * NUM_ITEMS;
+  int thread_start_index = thread_id * NUM_ITEMS;
+
+  //Let all threads get up and running
+  //Want the concurrent malloc calls to be as high as possible
+  pthread_barrier_wait(&barrier); 
+
+  for (i=0; i < NUM_ITEMS; i++) {
+    index = i + thread_start_index;
+    malloc_items[index].address = (int *)MALLOC(malloc_items[index].bytes);
+    malloc_items[index].free = 0;
+
+    if ((i % 3) == 0) { //Free some items, telling the size
+      FREE_SIZED(malloc_items[counter].address, malloc_items[counter].bytes);
+      malloc_items[counter].free = 1;
+      counter++;
+    } //if
+  } //for i
+
+  //Allocate the freed sizes again, so sized frees get reused, half of
+  //them shrunk by realloc from a little more
+  for (i=thread_start_index; i < counter; i += 2) {
+    if ((i % 4) == 0) {
+      malloc_items[i].address = (int *)MALLOC(malloc_items[i].bytes);
+    } else {
+      int *p = (int *)MALLOC(malloc_items[i].bytes + 16);
+      malloc_items[i].address = (int *)REALLOC(p, malloc_items[i].bytes);
+    } //else
+    malloc_items[i].free = 0;
+  } //for i
+
+  pthread_barrier_wait(&barrier);
+}
+
+
+void *allocate(void *arg) {
+  int id = *((int *) arg);
+  do_allocate(id);
+  return NULL;
+} 
+
+
+int main(int argc, char *argv[])
+{
+  int i, j;
+
+  srand(0);
+
+  //Slab, cached and heap sizes
+  const unsigned chunk_size = 16;
+  const unsigned min_chunks = 1;
+  const unsigned max_chunks = 128;
+  for (i=0; i < NUM_THREADS*NUM_ITEMS; i++) {
+    unsigned num_chunks = (rand() % (max_chunks - min_chunks + 1)) + min_chunks;
+    malloc_items[i].bytes = num_chunks * chunk_size;
+  } //for i
+
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  for (i=0; i < NUM_THREADS; i++) {
+    thread_id[i] = i;
+    pthread_create(&threads[i], NULL, allocate, (void *)(&thread_id[i]));
+  } //for i
+
+  for (i=0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  } //for i
+
+  //Check for correctness!
+
+  int *start, *end, *tgt_start, *tgt_end;
+  int fail = 0;
+  for (i=0; i < NUM_THREADS * NUM_ITEMS; i++) {
+    if (malloc_items[i].free == 1) continue;
+    start = malloc_items[i].address;
+    end   = start + (malloc_items[i].bytes / sizeof(int));
+
+    for (j=0; j < NUM_THREADS * NUM_ITEMS; j++) {
+      if (malloc_items[j].free == 1) continue;
+      if (i == j) continue;
+      tgt_start = malloc_items[j].address;
+      tgt_end   = tgt_start + (malloc_items[j].bytes / sizeof(int));
+      //Regions are half-open [start, end): touching is not overlapping
+      if ((start < tgt_end) && (tgt_start < end)) {
+	fail = 1;
+	break;
+      } //if
+    }
+
+    if (fail == 1) break;
+  } //for i
+
+  //Every byte counted out must be counted back, however the size was
+  //told
+  int k;
+  for (k=0; k < NUM_THREADS * NUM_ITEMS; k++) {
+    if (malloc_items[k].free == 0) {
+      FREE_SIZED(malloc_items[k].address, malloc_items[k].bytes);
+    } //if
+  } //for k
+  ts_malloc_stats_t stats;
+  ts_malloc_stats(&stats);
+
+  if (fail == 0 && stats.in_use_bytes == 0) {
+    printf("No overlapping allocated regions found!\n");
+    printf("Test passed\n");
+  } else if (fail == 0) {
+    printf("%zu bytes still counted in use after every free\n",
+           stats.in_use_bytes);
+    printf("Test failed\n");
+  } else {
+    printf("Found 2 overlapping allocated regions.\n");
+    printf("Region 1 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", start, end, malloc_items[i].bytes, i);
+    printf("Region 2 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", tgt_start, tgt_end, malloc_items[j].bytes, j);
+    printf("Test failed\n");
+  } //else
+
+  return 0;
+}
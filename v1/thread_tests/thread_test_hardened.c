@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "my_malloc.h"
+
+#ifdef LOCK_VERSION
+#define MALLOC(sz) ts_malloc_lock(sz)
+#define FREE(p)    ts_free_lock(p)
+#define FOREIGN_MALLOC(sz) ts_malloc_nolock(sz)
+#endif
+#ifdef NOLOCK_VERSION
+#define MALLOC(sz) ts_malloc_nolock(sz)
+#define FREE(p)    ts_free_nolock(p)
+#define FOREIGN_MALLOC(sz) ts_malloc_lock(sz)
+#endif
+#ifdef TCACHE_VERSION
+#define MALLOC(sz) ts_malloc_tcache(sz)
+#define FREE(p)    ts_free_tcache(p)
+#define FOREIGN_MALLOC(sz) ts_malloc_lock(sz)
+#endif
+#ifdef LOCKFREE_VERSION
+#define MALLOC(sz) ts_malloc_lockfree(sz)
+#define FREE(p)    ts_free_lockfree(p)
+#define FOREIGN_MALLOC(sz) ts_malloc_tcache(sz)
+#endif
+#ifdef RUNTIME_VERSION
+#define MALLOC(sz) ts_malloc(sz)
+#define FREE(p)    ts_free(p)
+#define FOREIGN_MALLOC(sz) ts_malloc_lockfree(sz)
+#endif
+
+#define NUM_THREADS  4
+#define NUM_ITEMS    5000
+
+pthread_t threads[NUM_THREADS];
+int       thread_id[NUM_THREADS];
+
+pthread_barrier_t barrier;
+
+struct malloc_list {
+  size_t bytes;
+  int *address;
+};
+typedef struct malloc_list malloc_list_t;
+
+malloc_list_t malloc_items[NUM_THREADS * NUM_ITEMS];
+
+
+//Each thread allocates its share, then frees its neighbour's
+void *churn(void *arg) {
+  int id = *((int *) arg);
+  int i, start = id * NUM_ITEMS;
+  int other = ((id + 1) % NUM_THREADS) * NUM_ITEMS;
+
+  for (i=start; i < start + NUM_ITEMS; i++) {
+    malloc_items[i].address = (int *)MALLOC(malloc_items[i].bytes);
+    memset(malloc_items[i].address, id, malloc_items[i].bytes);
+    if ((i % 2) == 0) {
+      FREE(malloc_items[i].address);
+      malloc_items[i].address = NULL;
+    } //if
+  } //for i
+
+  pthread_barrier_wait(&barrier);
+
+  for (i=other; i < other + NUM_ITEMS; i++) {
+    FREE(malloc_items[i].address);
+  } //for i
+  return NULL;
+}
+
+
+//Run a misuse in a child, which must die of SIGABRT
+int misuse_aborts(size_t bytes, int offset, int twice, int foreign) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, 2);
+    char *p = foreign ? FOREIGN_MALLOC(bytes) : MALLOC(bytes);
+    FREE(p + offset);
+    if (twice) {
+      FREE(p + offset);
+    } //if
+    _exit(0);
+  } //if
+
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+
+int main(int argc, char *argv[])
+{
+  int i;
+  setenv("TS_HARDENED", "1", 1);
+
+  srand(0);
+
+  //Slab, cached and heap sizes
+  for (i=0; i < NUM_THREADS*NUM_ITEMS; i++) {
+    malloc_items[i].bytes = ((rand() % 128) + 1) * 16;
+  } //for i
+
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  for (i=0; i < NUM_THREADS; i++) {
+    thread_id[i] = i;
+    pthread_create(&threads[i], NULL, churn, (void *)(&thread_id[i]));
+  } //for i
+
+  for (i=0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  } //for i
+
+  int fail = 0;
+  int problems = ts_malloc_check();
+  if (problems != 0) {
+    printf("ts_malloc_check found %d problems\n", problems);
+    fail = 1;
+  } //if
+
+  //Double frees, interior pointers and another version's memory; a
+  //large mapping is gone after its first free and any version may
+  //free it, so only its interior is tried
+  int foreign = strcmp(ts_malloc_engine(), "lockfree") != 0;
+#ifndef RUNTIME_VERSION
+  foreign = 1;
+#endif
+  size_t sizes[] = { 32, 2000, 1 << 20 };
+  for (i=0; i < 3; i++) {
+    if (i < 2 && !misuse_aborts(sizes[i], 0, 1, 0)) {
+      printf("Double free of %zu bytes went unnoticed\n", sizes[i]);
+      fail = 1;
+    } //if
+    if (!misuse_aborts(sizes[i], 16, 0, 0)) {
+      printf("Free inside %zu bytes went unnoticed\n", sizes[i]);
+      fail = 1;
+    } //if
+    if (i < 2 && foreign && !misuse_aborts(sizes[i], 0, 0, 1)) {
+      printf("Free of another version's %zu bytes went unnoticed\n",
+             sizes[i]);
+      fail = 1;
+    } //if
+  } //for i
+
+  //A lock-free object handed out again by calloc is no longer freed,
+  //however little of it is cleared
+  for (i=0; i < 2; i++) {
+    char *p = ts_calloc_lockfree(1, 4);
+    if (p == NULL || p[0] != 0 || p[3] != 0) {
+      printf("ts_calloc_lockfree returned unusable memory\n");
+      fail = 1;
+      break;
+    } //if
+    ts_free_lockfree(p);
+  } //for i
+
+  if (fail == 0) {
+    printf("Misuse was caught and the free lists are sound\n");
+    printf("Test passed\n");
+  } else {
+    printf("Test failed\n");
+  } //else
+
+  return 0;
+}
@@ -13,6 +13,18 @@
 #define MALLOC(sz) ts_malloc_nolock(sz)
 #define FREE(p)    ts_free_nolock(p)
 #endif
+#ifdef TCACHE_VERSION
+#define MALLOC(sz) ts_malloc_tcache(sz)
+#define FREE(p)    ts_free_tcache(p)
+#endif
+#ifdef LOCKFREE_VERSION
+#define MALLOC(sz) ts_malloc_lockfree(sz)
+#define FREE(p)    ts_free_lockfree(p)
+#endif
+#ifdef RUNTIME_VERSION
+#define MALLOC(sz) ts_malloc(sz)
+#define FREE(p)    ts_free(p)
+#endif
 
 #define NUM_THREADS  4
 #define NUM_ITEMS    20000
@@ -96,6 +108,7 @@ int main(int argc, char *argv[])
   int i, j;
   struct timespec start_time, end_time;
   void *start_segment_addr, *end_segment_addr;
+  ts_malloc_stats_t start_stats, end_stats;
 
   srand(0);
 
@@ -112,6 +125,7 @@ int main(int argc, char *argv[])
   pthread_barrier_init(&barrier, NULL, NUM_THREADS);
 
   start_segment_addr = sbrk(0);
+  ts_malloc_stats(&start_stats);
   clock_gettime(CLOCK_MONOTONIC, &start_time);
   for (i=0; i < NUM_THREADS; i++) {
     thread_id[i] = i;
@@ -122,6 +136,7 @@ int main(int argc, char *argv[])
   } //for i
   clock_gettime(CLOCK_MONOTONIC, &end_time);
   end_segment_addr = sbrk(0);
+  ts_malloc_stats(&end_stats);
 
   //Check for correctness!
 
@@ -137,8 +152,8 @@ int main(int argc, char *argv[])
       if (i == j) continue;
       tgt_start = malloc_items[j].address;
       tgt_end   = tgt_start + (malloc_items[j].bytes / sizeof(int));
-      if (((start >= tgt_start) && (start <= tgt_end)) ||
-	  ((end >= tgt_start) && (end <= tgt_end))) {
+      //Regions are half-open [start, end): touching is not overlapping
+      if ((start < tgt_end) && (tgt_start < end)) {
 	fail = 1;
 	break;
       } //if
@@ -147,7 +162,18 @@ int main(int argc, char *argv[])
     if (fail == 1) break;
   } //for i
 
-  if (fail == 0) {
+  //Every allocation still live must show up in the statistics
+  size_t live = 0;
+  for (i=0; i < NUM_THREADS * NUM_ITEMS; i++) {
+    if (malloc_items[i].free == 0) live++;
+  } //for i
+  size_t counted = (end_stats.mallocs - start_stats.mallocs) -
+                   (end_stats.frees - start_stats.frees);
+
+  if (fail == 0 && counted != live) {
+    printf("Statistics count %zu live allocations, expected %zu\n", counted, live);
+    printf("Test failed\n");
+  } else if (fail == 0) {
     printf("No overlapping allocated regions found!\n");
     printf("Test passed\n");
   } else {
@@ -166,6 +192,7 @@ int main(int argc, char *argv[])
   double elapsed_ns = calc_time(start_time, end_time);
   printf("Execution Time = %f seconds\n", elapsed_ns / 1e9);
   printf("Data Segment Size = %lu bytes\n", (unsigned long)(end_segment_addr - start_segment_addr));
+  printf("Heap In Use = %zu bytes, Mapped = %zu bytes\n", end_stats.in_use_bytes, end_stats.mapped_bytes);
 
   return 0;
 }
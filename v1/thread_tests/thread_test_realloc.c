@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "my_malloc.h"
+
+#ifdef LOCK_VERSION
+#define MALLOC(sz)     ts_malloc_lock(sz)
+#define FREE(p)        ts_free_lock(p)
+#define REALLOC(p, sz) ts_realloc_lock(p, sz)
+#endif
+#ifdef NOLOCK_VERSION
+#define MALLOC(sz)     ts_malloc_nolock(sz)
+#define FREE(p)        ts_free_nolock(p)
+#define REALLOC(p, sz) ts_realloc_nolock(p, sz)
+#endif
+#ifdef TCACHE_VERSION
+#define MALLOC(sz)     ts_malloc_tcache(sz)
+#define FREE(p)        ts_free_tcache(p)
+#define REALLOC(p, sz) ts_realloc_tcache(p, sz)
+#endif
+#ifdef LOCKFREE_VERSION
+#define MALLOC(sz)     ts_malloc_lockfree(sz)
+#define FREE(p)        ts_free_lockfree(p)
+#define REALLOC(p, sz) ts_realloc_lockfree(p, sz)
+#endif
+#ifdef RUNTIME_VERSION
+#define MALLOC(sz)     ts_malloc(sz)
+#define FREE(p)        ts_free(p)
+#define REALLOC(p, sz) ts_realloc(p, sz)
+#endif
+
+#define NUM_THREADS  4
+#define NUM_ITEMS    2000
+#define NUM_RESIZES  8
+
+pthread_t threads[NUM_THREADS];
+int       thread_id[NUM_THREADS];
+
+pthread_barrier_t barrier;
+
+struct malloc_list {
+  size_t bytes;
+  int *address;
+  int free;
+};
+typedef struct malloc_list malloc_list_t;
+
+malloc_list_t malloc_items[NUM_THREADS * NUM_ITEMS];
+int corrupted[NUM_THREADS];
+
+//Every int of an item holds its index, so a move that loses data shows
+void fill(int index, size_t from, size_t to) {
+  size_t k;
+  for (k = from / sizeof(int); k < to / sizeof(int); k++) {
+    malloc_items[index].address[k] = index;
+  }
+}
+
+int check(int index, size_t bytes) {
+  size_t k;
+  for (k = 0; k < bytes / sizeof(int); k++) {
+    if (malloc_items[index].address[k] != index) return 0;
+  }
+  return 1;
+}
+
+void do_allocate(int thread_id) {
+  int i, r, index;
+  int thread_start_index = thread_id * NUM_ITEMS;
+  size_t old_bytes, new_bytes;
+
+  //Let all threads get up and running
+  //Want the concurrent malloc calls to be as high as possible
+  pthread_barrier_wait(&barrier); 
+
+  for (i=0; i < NUM_ITEMS; i++) {
+    index = i + thread_start_index;
+    malloc_items[index].address = (int *)MALLOC(malloc_items[index].bytes);
+    malloc_items[index].free = 0;
+    fill(index, 0, malloc_items[index].bytes);
+  } //for i
+
+  //Free every third item so some neighbours can be grown into
+  for (i=0; i < NUM_ITEMS; i += 3) {
+    index = i + thread_start_index;
+    FREE(malloc_items[index].address);
+    malloc_items[index].free = 1;
+  } //for i
+
+  //Grow and shrink the survivors, from slab sizes up to mmap sizes
+  for (r=0; r < NUM_RESIZES; r++) {
+    for (i=0; i < NUM_ITEMS; i++) {
+      index = i + thread_start_index;
+      if (malloc_items[index].free == 1) continue;
+      old_bytes = malloc_items[index].bytes;
+      if (r == NUM_RESIZES - 1) {
+        new_bytes = old_bytes / 4 + sizeof(int);
+      } else if ((i % 50) == 1 && r < 5) {
+        new_bytes = old_bytes * 4;
+      } else {
+        new_bytes = old_bytes + 32 * (r + 1);
+      }
+      malloc_items[index].address = (int *)REALLOC(malloc_items[index].address, new_bytes);
+      malloc_items[index].bytes = new_bytes;
+      if (!check(index, old_bytes < new_bytes ? old_bytes : new_bytes)) {
+        corrupted[thread_id]++;
+      }
+      if (new_bytes > old_bytes) {
+        fill(index, old_bytes, new_bytes);
+      }
+    } //for i
+  } //for r
+
+  pthread_barrier_wait(&barrier);
+}
+
+
+void *allocate(void *arg) {
+  int id = *((int *) arg);
+  do_allocate(id);
+  return NULL;
+} 
+
+
+int main(int argc, char *argv[])
+{
+  int i, j;
+
+  srand(0);
+
+  const unsigned chunk_size = 32;
+  const unsigned min_chunks = 1;
+  const unsigned max_chunks = 16;
+  for (i=0; i < NUM_THREADS*NUM_ITEMS; i++) {
+    unsigned num_chunks = (rand() % (max_chunks - min_chunks + 1)) + min_chunks;
+    malloc_items[i].bytes = num_chunks * chunk_size;
+  } //for i
+
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  for (i=0; i < NUM_THREADS; i++) {
+    thread_id[i] = i;
+    pthread_create(&threads[i], NULL, allocate, (void *)(&thread_id[i]));
+  } //for i
+
+  for (i=0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  } //for i
+
+  //Check for correctness!
+
+  int *start, *end, *tgt_start, *tgt_end;
+  int fail = 0;
+  for (i=0; i < NUM_THREADS; i++) {
+    if (corrupted[i] != 0) {
+      printf("Thread %d saw %d items whose contents did not survive realloc\n", i, corrupted[i]);
+      fail = 2;
+    } //if
+  } //for i
+
+  for (i=0; fail == 0 && i < NUM_THREADS * NUM_ITEMS; i++) {
+    if (malloc_items[i].free == 1) continue;
+    start = malloc_items[i].address;
+    end   = start + (malloc_items[i].bytes / sizeof(int));
+
+    for (j=0; j < NUM_THREADS * NUM_ITEMS; j++) {
+      if (malloc_items[j].free == 1) continue;
+      if (i == j) continue;
+      tgt_start = malloc_items[j].address;
+      tgt_end   = tgt_start + (malloc_items[j].bytes / sizeof(int));
+      //Regions are half-open [start, end): touching is not overlapping
+      if ((start < tgt_end) && (tgt_start < end)) {
+	fail = 1;
+	break;
+      } //if
+    }
+
+    if (fail == 1) break;
+  } //for i
+
+  if (fail == 0) {
+    printf("No overlapping allocated regions found!\n");
+    printf("Test passed\n");
+  } else if (fail == 1) {
+    printf("Found 2 overlapping allocated regions.\n");
+    printf("Region 1 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", start, end, malloc_items[i].bytes, i);
+    printf("Region 2 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", tgt_start, tgt_end, malloc_items[j].bytes, j);
+    printf("Test failed\n");
+  } else {
+    printf("Test failed\n");
+  } //else
+
+  for (i=0; i < NUM_THREADS * NUM_ITEMS; i++) {
+    if (malloc_items[i].free == 0) {
+      FREE(malloc_items[i].address);
+    } //if
+  } //for i
+
+  return 0;
+}